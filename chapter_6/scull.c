@@ -25,6 +25,38 @@
 #include <asm/semaphore.h>
 #include <linux/ioctl.h>
 #include <linux/capability.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/time.h>
+#include <linux/jiffies.h>
+#include <linux/bitops.h>
+#include <linux/vmalloc.h>
+#include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/cache.h>
+#include <linux/crc32c.h>
+#include <linux/file.h>
+#include <linux/limits.h>
+#include <linux/idr.h>
+#include <linux/miscdevice.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <asm/div64.h>
+#include <linux/uio.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/timer.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+
+#include "scull.h"
 
   
 #define SCULL_IOC_MAGIC 'k'
@@ -49,17 +81,322 @@
 #define SCULL_IOCXQSET	  _IOWR(SCULL_IOC_MAGIC, 10, int)
 #define SCULL_IOCHQUANTUM _IO(SCULL_IOC_MAGIC,   11)
 #define SCULL_IOCHQSET	  _IO(SCULL_IOC_MAGIC,   12)
+/* per-device geometry, the data is re-laid out in the background */
+#define SCULL_IOCSGEOM    _IOW(SCULL_IOC_MAGIC,  13, struct scull_geom)
+#define SCULL_IOCGGEOM    _IOR(SCULL_IOC_MAGIC,  14, struct scull_geom)
+/* adaptive quantum sizing, on/off and statistics */
+#define SCULL_IOCSADAPT   _IOW(SCULL_IOC_MAGIC,  15, int)
+#define SCULL_IOCGADAPT   _IOR(SCULL_IOC_MAGIC,  16, struct scull_adapt_info)
+/* storage mode, see SCULL_MODE_*; setting it discards the contents */
+#define SCULL_IOCSMODE    _IOW(SCULL_IOC_MAGIC,  17, struct scull_mode)
+#define SCULL_IOCGMODE    _IOR(SCULL_IOC_MAGIC,  18, struct scull_mode)
+#define SCULL_IOCGWINDOW  _IOR(SCULL_IOC_MAGIC,  19, struct scull_window)
+#define SCULL_IOCQRECORDS _IO(SCULL_IOC_MAGIC,   20)
+/* key-value mode */
+#define SCULL_IOCKVGET    _IOWR(SCULL_IOC_MAGIC, 21, struct scull_kv)
+#define SCULL_IOCKVPUT    _IOW(SCULL_IOC_MAGIC,  22, struct scull_kv)
+#define SCULL_IOCKVDEL    _IOW(SCULL_IOC_MAGIC,  23, struct scull_kv)
+#define SCULL_IOCKVMGET   _IOWR(SCULL_IOC_MAGIC, 24, struct scull_kv_batch)
+/* make a device immutable for good, reads stop taking the semaphore */
+#define SCULL_IOCSEAL     _IO(SCULL_IOC_MAGIC,   25)
+#define SCULL_IOCQSEAL    _IO(SCULL_IOC_MAGIC,   26)
+/* per open file: stage small adjacent writes, flush whole quanta */
+#define SCULL_IOCSCOALESCE _IOW(SCULL_IOC_MAGIC, 27, int)
+/* per-quantum crc32c, checked on read and by a background scrubber */
+#define SCULL_IOCSCRC     _IOW(SCULL_IOC_MAGIC,  28, int)
+#define SCULL_IOCSSCRUB   _IOW(SCULL_IOC_MAGIC,  29, int)
+#define SCULL_IOCGSCRUB   _IOR(SCULL_IOC_MAGIC,  30, struct scull_scrub_stats)
+/* stream the device to and from its backing file */
+#define SCULL_IOCSAVE     _IO(SCULL_IOC_MAGIC,   31)
+#define SCULL_IOCRESTORE  _IO(SCULL_IOC_MAGIC,   32)
+#define SCULL_IOCCHECKPOINT _IO(SCULL_IOC_MAGIC, 33)
+/* RAM budget in bytes, cold quanta beyond it go to the tier file */
+#define SCULL_IOCSTIER    _IOW(SCULL_IOC_MAGIC,  34, unsigned long)
+#define SCULL_IOCGTIER    _IOR(SCULL_IOC_MAGIC,  35, struct scull_tier_info)
+
+/* map of the populated ranges, adjacent quanta merged */
+#define SCULL_IOCFIEMAP   _IOWR(SCULL_IOC_MAGIC, 36, struct scull_fiemap)
+/* per open file: reads at the end wait for the device to grow */
+#define SCULL_IOCSFOLLOW  _IOW(SCULL_IOC_MAGIC,  37, int)
+#define SCULL_IOCTXN      _IOW(SCULL_IOC_MAGIC,  38, struct scull_txn)
+#define SCULL_IOCGPOOL    _IOR(SCULL_IOC_MAGIC,  39, struct scull_pool_info)
+#define SCULL_IOCPREALLOC _IOW(SCULL_IOC_MAGIC,  40, struct scull_prealloc)
+/* where quanta come from, switching empties the device */
+#define SCULL_IOCSBACKEND _IOW(SCULL_IOC_MAGIC,  41, struct scull_backend)
+#define SCULL_IOCGBACKEND _IOR(SCULL_IOC_MAGIC,  42, struct scull_backend)
+#define SCULL_IOCLOGSEEK  _IOWR(SCULL_IOC_MAGIC, 43, struct scull_logseek)
 
-#define SCULL_IOC_MAXNR 	14
+#define SCULL_IOC_MAXNR 	43
+
+/* on /dev/scull-control, the argument is the index or -1 for any */
+#define SCULL_CTL_ADD     _IO(SCULL_IOC_MAGIC,   0x80)
+#define SCULL_CTL_REMOVE  _IO(SCULL_IOC_MAGIC,   0x81)
 #define SCULL_QUANTUM  		4096
 #define SCULL_QSET		1024  
 
+#define SCULL_HIST_BUCKETS	21		/* log2 buckets, 1 byte to 1 MiB */
+#define SCULL_ADAPT_WINDOW	256		/* writes per decision */
+#define SCULL_ADAPT_MIN		512
+#define SCULL_ADAPT_MAX		(128 * 1024)	/* largest kmalloc */
+#define SCULL_ADAPT_STREAM_SHIFT 6		/* streaming: 64 writes a quantum */
+#define SCULL_ADAPT_STREAM_MIN	4096		/* and at least this much */
+#define SCULL_ADAPT_HOLDOFF	(10 * HZ)	/* min gap between re-layouts */
+
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Jax");
 
+struct scull_geom {
+	int quantum;
+	int qset;
+};
+
+#define SCULL_MODE_PLAIN	0
+#define SCULL_MODE_RING		1	/* fixed capacity, oldest data recycled */
+#define SCULL_MODE_LOG		2	/* every write is an indexed record */
+#define SCULL_MODE_KV		3	/* key-value store, capacity caps memory */
+
+/* log mode: move the file to a record, by number or by time */
+struct scull_logseek {
+	__u64 key;			/* record number, or ns */
+	__u32 by_time;			/* first record at or after key */
+	__u32 pad;
+	__u64 off;			/* out: new file position */
+};
+
+struct scull_mode {
+	__u32 mode;
+	__u32 pad;
+	__u64 capacity;			/* bytes, ring mode only */
+};
+
+/* readable data lives in [start, size) */
+struct scull_window {
+	__u64 start;
+	__u64 size;
+};
+
+/* populated ranges of [start, start + length), as FIEMAP does for files */
+struct scull_fiemap_extent {
+	__u64 off;
+	__u64 len;
+	__u32 flags;
+	__u32 pad;
+};
+#define SCULL_EXTENT_LAST	1	/* nothing populated past this one */
+
+/* a batch of writes readers see all or none of */
+struct scull_txn_range {
+	__u64 off;
+	__u64 len;
+	const void __user *buf;
+};
+
+struct scull_txn {
+	__u32 n;			/* ranges, applied in order */
+	__u32 pad;
+	struct scull_txn_range __user *ranges;
+};
+#define SCULL_TXN_MAX		64
+#define SCULL_TXN_BYTES		(16 << 20)
+
+/* populate [off, off + len) ahead of the writes that will land there */
+struct scull_prealloc {
+	__u64 off;
+	__u64 len;
+	__u32 flags;
+	__u32 pad;
+};
+#define SCULL_PREALLOC_KEEP_SIZE 1	/* don't move size up to off + len */
+
+#define SCULL_BACKEND_KMALLOC	0	/* kmalloc, one page for PAGE_SIZE */
+#define SCULL_BACKEND_PAGES	1	/* __get_free_pages, as scullp */
+#define SCULL_BACKEND_VMALLOC	2	/* vmalloc, as scullv */
+
+struct scull_backend {
+	int type;
+	int order;			/* pages: quantum is PAGE_SIZE << order */
+};
+
+struct scull_fiemap {
+	__u64 start;
+	__u64 length;
+	__u32 count;			/* room in extents, 0 only counts */
+	__u32 mapped;			/* extents found */
+	struct scull_fiemap_extent __user *extents;
+};
+
+/*
+ * Everything is indexed by the quantum size in log2 buckets: hist[] by
+ * the size of each write, tp_bytes[]/tp_ns[] by the quantum in use
+ * when the write happened, so fixed and adaptive runs can be compared.
+ */
+struct scull_adapt_info {
+	__u32 enabled;
+	__u32 quantum;
+	__u32 fixed_quantum;
+	__u32 relayouts;
+	__u64 size;
+	__u64 alloc_bytes;
+	__u64 meta_bytes;
+	__u64 fixed_alloc_bytes;	/* same data at fixed_quantum */
+	__u64 seq_writes;
+	__u64 rand_writes;
+	__u64 hist[SCULL_HIST_BUCKETS];
+	__u64 tp_bytes[SCULL_HIST_BUCKETS];
+	__u64 tp_ns[SCULL_HIST_BUCKETS];
+};
+
+struct scull_adapt {
+	int enabled;
+	int pending;			/* class the last window voted for */
+	unsigned long next;		/* jiffies of the next allowed re-layout */
+	unsigned long last_end;
+	unsigned int win_writes;
+	unsigned int win_seq;
+	unsigned int win_hist[SCULL_HIST_BUCKETS];
+	unsigned int relayouts;
+	u64 seq;
+	u64 rand;
+	u64 hist[SCULL_HIST_BUCKETS];
+	u64 tp_bytes[SCULL_HIST_BUCKETS];
+	u64 tp_ns[SCULL_HIST_BUCKETS];
+};
+
+/*
+ * One key-value operation. For GET, vlen is the size of the buffer on
+ * the way in and the length of the stored value on the way out; a value
+ * longer than the buffer is cut short. ttl_ms is only used by PUT.
+ */
+struct scull_kv {
+	const void __user *key;
+	void __user *val;
+	__u32 klen;
+	__u32 vlen;
+	__u32 ttl_ms;			/* 0 never expires */
+	__s32 status;			/* per key result of a batch */
+};
+
+struct scull_kv_batch {
+	__u32 n;
+	__u32 pad;
+	struct scull_kv __user *kvs;
+};
+
+#define SCULL_KV_KEYMAX		256
+#define SCULL_KV_BATCH_MAX	256	/* lookups per SCULL_IOCKVMGET */
+#define SCULL_KV_SLOTS		4	/* entries in one cache line bucket */
+
+struct scull_kv_entry {
+	struct list_head lru;
+	unsigned long expires;		/* jiffies, 0 never */
+	void **quanta;			/* the value, quantum by quantum */
+	size_t vlen;
+	u32 hash;
+	u32 klen;
+	char key[0];
+};
+
+/*
+ * The hashes sit next to each other so a miss is decided without
+ * touching any entry. Full buckets chain to an overflow bucket.
+ */
+struct scull_kv_bucket {
+	u32 hash[SCULL_KV_SLOTS];
+	struct scull_kv_entry *ent[SCULL_KV_SLOTS];
+	struct scull_kv_bucket *next;
+} ____cacheline_aligned;
+
+struct scull_kv_table {
+	struct scull_kv_bucket *buckets;
+	unsigned long nbuckets;		/* power of two */
+	unsigned long count;
+	struct list_head lru;		/* most recently used first */
+};
+
+struct scull_rec {
+	unsigned long off;
+	u64 ts;				/* ns, never goes backwards */
+};
+
+/*
+ * Backing file image: a base segment, then any number of delta
+ * segments. A segment is a header, then extents, each a struct
+ * scull_img_extent followed by its len bytes of data, then an extent
+ * at SCULL_IMG_END. Restoring replays the segments in order.
+ */
+#define SCULL_IMG_MAGIC		0x5343554c	/* "SCUL" */
+#define SCULL_IMG_VERSION	2
+#define SCULL_IMG_BASE		0		/* complete image */
+#define SCULL_IMG_DELTA		1		/* quanta changed since gen - 1 */
+#define SCULL_IMG_END		(~0ULL)		/* extent offset ending a segment */
+#define SCULL_IO_CHUNK		(1024 * 1024)	/* bytes per kernel read/write */
+
+struct scull_img_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 quantum;
+	__u32 qset;
+	__u32 type;
+	__u32 gen;			/* 0 for the base, +1 per delta */
+	__u64 size;
+};
+
+struct scull_img_extent {
+	__u64 off;
+	__u64 len;
+};
+
+struct scull_scrub_stats {
+	__u32 crc;			/* checksums kept */
+	__u32 rate;			/* scrubbed quanta per second, 0 idle */
+	__u64 scanned;
+	__u64 scrub_errors;		/* mismatches found by the scrubber */
+	__u64 read_errors;		/* mismatches found by read() */
+	__u64 bytes;
+	__u64 ns;			/* time spent checksumming */
+};
+
+struct scull_tier_info {
+	__u64 budget;			/* bytes of quanta kept in RAM, 0 off */
+	__u64 resident;			/* bytes in RAM */
+	__u64 spilled;			/* bytes in the tier file */
+	__u64 hits;			/* lookups served from RAM */
+	__u64 faults;			/* lookups that read the tier file */
+	__u64 evictions;
+	__u64 fault_ns;			/* time spent faulting in */
+	__u64 fault_ns_max;
+};
+
+struct scull_pool_info {
+	__u32 size;			/* quanta the pool is topped up to */
+	__u32 nr;			/* quanta in it now */
+	__u64 hits;			/* allocations served from the pool */
+	__u64 misses;			/* ... that went to the allocator */
+	__u64 refilled;			/* quanta added by the refill work */
+	__u64 refill_runs;
+	__u64 refill_ns;		/* time spent refilling */
+	__u64 refill_ns_max;		/* longest single run */
+};
+
+/*
+ * A node carries its qset quantum pointers inline, right after the
+ * header, and comes from a cache-line aligned slab for its qset size.
+ */
 struct scull_qset {
-	void **data;
 	struct scull_qset *next;
+	u32 *crc;			/* crc32c of each quantum, if enabled */
+	unsigned long *dirty;		/* quanta written since the checkpoint */
+	int ndirty;
+	unsigned long *ref;		/* tiering: looked up since the hand passed */
+	u32 *spill;			/* tiering: tier file slot + 1, 0 in RAM */
+	void **data;			/* just past the node, or on its own */
+};
+
+/* Where a byte lives, as found by scull_locate_slot() */
+struct scull_slot {
+	struct scull_qset *dptr;
+	int s_pos;
+	int quantum;
 };
 
 struct scull_dev {
@@ -69,188 +406,3758 @@ struct scull_dev {
 	unsigned long size;
 	//unsigned int access_key;
 	struct semaphore sem;
-	struct cdev cdev;
+	int users;			/* open files, under scull_devs_sem */
+	int pinned;			/* geometry set per device, kept over trim */
+	int migrating;
+	struct task_struct *mig_task;	/* set until its exit is collected */
+	struct completion mig_done;
+	int mig_stop;
+	struct scull_qset *mig_data;	/* new layout, holds [0, mig_pos) */
+	struct scull_qset *mig_old;	/* old nodes left to free, one a step */
+	int mig_quantum;
+	int mig_qset;
+	struct scull_qset_cache *qc;	/* nodes of qset entries */
+	struct scull_qset_cache *mig_qc;	/* and of mig_qset entries */
+	unsigned long mig_pos;
+	unsigned long alloc_bytes;	/* bytes held in quanta */
+	int backend;			/* SCULL_BACKEND_*, fixed while data */
+	int mode;
+	unsigned long capacity;		/* ring mode, bytes */
+	unsigned long ring_quanta;	/* ring mode, capacity in quanta */
+	unsigned long start;		/* first readable byte */
+	struct scull_rec *recs;		/* log mode index, record n at recs[n] */
+	unsigned long nr_recs;
+	unsigned long max_recs;
+	struct scull_kv_table kv;
+	int sealed;
+	char *flat;			/* sealed contents, [flat_base, size) */
+	unsigned long flat_base;
+	int crc_on;
+	int scrub_rate;
+	struct task_struct *scrub_task;
+	unsigned long scrub_pos;
+	struct scull_scrub_stats scrub;
+	int index;
+	int restore_pending;		/* lazy restore on first open */
+	int dirty_track;		/* a base is on file, track changes */
+	int ckpt_need_base;		/* dirty bits can't be trusted */
+	unsigned int ckpt_gen;
+	loff_t ckpt_base_bytes;		/* size of the last base segment */
+	loff_t ckpt_delta_bytes;	/* deltas appended since */
+	struct task_struct *ckpt_task;
+	unsigned long tier_budget;	/* bytes of quanta in RAM, 0 no tiering */
+	struct file *tier_file;
+	unsigned long *tier_map;	/* tier file slots in use */
+	unsigned long tier_nslots;
+	struct scull_qset *tier_hand;	/* clock hand, node and quantum */
+	int tier_hand_pos;
+	struct scull_tier_info tier;
+	wait_queue_head_t inq;		/* followers waiting for growth */
+	atomic_t followers;		/* files in follow mode */
+	atomic_t staging;		/* files with staged bytes, seal and
+					   mode changes wait for them */
+	struct timer_list follow_timer;	/* batches their wakeups */
+	unsigned long gifted;		/* pages taken over from splice */
+	spinlock_t pool_lock;		/* guards pool, pool_nr, pool_quantum,
+					   pool_backend */
+	void **pool;			/* zeroed quanta of pool_quantum bytes */
+	int pool_nr;
+	int pool_quantum;
+	int pool_backend;		/* and from this backend */
+	struct work_struct pool_work;
+	struct scull_pool_info pool_info;
+	struct scull_adapt adapt;
+};
+
+/* what filp->private_data points to */
+struct scull_file {
+	struct scull_dev *dev;
+	int coalesce;
+	int follow;
+	char *wbuf;			/* staged bytes for [wpos, wpos + wlen) */
+	size_t wlen;
+	size_t wsize;			/* room up to the next quantum boundary */
+	size_t wcap;			/* allocated size of wbuf */
+	loff_t wpos;
 };
 
 static int scull_minor = 0;
 static int scull_major = 0;
 static int scull_quantum = SCULL_QUANTUM;
 static int scull_qset = SCULL_QSET;
-static int scull_nr_devs = 4;
+static int scull_nr_devs = 256;		/* minors reserved for instances */
+static int scull_scrub_rate = 64;	/* default quanta per second */
+static char *scull_backing = NULL;	/* image path prefix, minor appended */
+static int scull_restore_lazy = 0;
+static int scull_ckpt_interval = 0;	/* seconds between checkpoints */
+static char *scull_tier_path = NULL;	/* tier file prefix, minor appended */
+static int scull_follow_ms = 10;	/* growth gathered per follower wakeup */
+static int scull_pool_size = 32;	/* zeroed quanta kept ready, 0 none */
+static int scull_backend = SCULL_BACKEND_KMALLOC;	/* of new devices */
+static int scull_order = 0;		/* pages backend, quantum order */
+static const char *scull_backend_name[] = { "kmalloc", "pages", "vmalloc" };
+static struct workqueue_struct *scull_pool_wq;
+static struct shrinker *scull_pool_shrinker;
 static dev_t dev = 0;
-static struct scull_dev *scull_dev = NULL;
+static struct cdev scull_cdev;
+
+/*
+ * Instances by index (minor - scull_minor). A reserved index that
+ * nobody opened yet maps to SCULL_DEV_RESERVED.
+ */
+static DEFINE_IDR(scull_idr);
+static DECLARE_MUTEX(scull_devs_sem);
+#define SCULL_DEV_RESERVED	((struct scull_dev *)1)
 
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
+module_param(scull_scrub_rate, int, S_IRUGO);
+module_param(scull_backing, charp, S_IRUGO);
+module_param(scull_restore_lazy, int, S_IRUGO);
+module_param(scull_ckpt_interval, int, S_IRUGO);
+module_param(scull_tier_path, charp, S_IRUGO);
+module_param(scull_follow_ms, int, S_IRUGO);
+module_param(scull_pool_size, int, S_IRUGO);
+module_param(scull_backend, int, S_IRUGO);
+module_param(scull_order, int, S_IRUGO);
 
-int scull_trim(struct scull_dev *dev)
-{
+static u64 scull_now_ns(void)
+{
+	struct timespec ts;
+
+	getnstimeofday(&ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * A quantum of exactly one page is a page of its own, so that a page
+ * handed over through splice can take the place of one. The pages
+ * backend takes every quantum as a block of 2^order pages, the vmalloc
+ * backend lets quanta grow past what kmalloc can give.
+ */
+static void *__scull_quantum_get(int backend, int quantum)
+{
+	switch (backend) {
+		case SCULL_BACKEND_PAGES:
+			return (void *)__get_free_pages(GFP_KERNEL,
+							get_order(quantum));
+		case SCULL_BACKEND_VMALLOC:
+			return vmalloc(quantum);
+	}
+	if (quantum == PAGE_SIZE)
+		return (void *)__get_free_page(GFP_KERNEL);
+	return kmalloc(quantum, GFP_KERNEL);
+}
+
+static void __scull_quantum_put(void *p, int backend, int quantum)
+{
+	/* put_page(): a page taken over from splice may be on the LRU */
+	if (backend == SCULL_BACKEND_VMALLOC)
+		vfree(p);
+	else if (quantum == PAGE_SIZE)
+		put_page(virt_to_page(p));
+	else if (backend == SCULL_BACKEND_PAGES)
+		free_pages((unsigned long)p, get_order(quantum));
+	else
+		kfree(p);
+}
+
+/*
+ * Each device keeps up to scull_pool_size zeroed quanta of its current
+ * size ready, so that a first write to a quantum doesn't wait on the
+ * slab. Taking one is a pop under pool_lock; once the pool is down to
+ * a quarter, the refill work is queued and tops it up off the write
+ * path, without dev->sem. A new device starts with an empty pool, the
+ * first miss fills it; trim and the shrinker empty it again.
+ */
+static void *scull_pool_pop(struct scull_dev *dev, int quantum)
+{
+	void *p = NULL;
+	int nr = 0;
+
+	if (!dev->pool)
+		return NULL;
+	spin_lock(&dev->pool_lock);
+	if (dev->pool_quantum == quantum &&
+	    dev->pool_backend == dev->backend && dev->pool_nr)
+		p = dev->pool[--dev->pool_nr];
+	nr = dev->pool_nr;
+	spin_unlock(&dev->pool_lock);
+	if (p)
+		dev->pool_info.hits++;
+	else
+		dev->pool_info.misses++;
+	if (nr < scull_pool_size / 4 + 1)
+		queue_work(scull_pool_wq, &dev->pool_work);
+	return p;
+}
+
+/* Free what the pool holds, e.g. after the quantum size changed */
+static void scull_pool_drain(struct scull_dev *dev, int backend, int quantum)
+{
+	int pb, pq;
+	void *p;
+
+	for (;;) {
+		/* another drainer may retag the pool once we let go */
+		spin_lock(&dev->pool_lock);
+		p = dev->pool_nr ? dev->pool[--dev->pool_nr] : NULL;
+		pb = dev->pool_backend;
+		pq = dev->pool_quantum;
+		if (!p) {
+			dev->pool_quantum = quantum;
+			dev->pool_backend = backend;
+		}
+		spin_unlock(&dev->pool_lock);
+		if (!p)
+			break;
+		__scull_quantum_put(p, pb, pq);
+	}
+}
+
+static void scull_pool_refill(void *data)
+{
+	struct scull_dev *dev = data;
+	int quantum = dev->quantum;
+	int backend = dev->backend;
+	unsigned long n = 0;
+	u64 t = scull_now_ns();
+	void *p;
+
+	if (quantum != dev->pool_quantum || backend != dev->pool_backend)
+		scull_pool_drain(dev, backend, quantum);
+	for (;;) {
+		p = __scull_quantum_get(backend, quantum);
+		if (!p)
+			break;
+		memset(p, 0, quantum);
+		spin_lock(&dev->pool_lock);
+		if (dev->pool_nr < scull_pool_size &&
+		    dev->pool_quantum == quantum &&
+		    dev->pool_backend == backend) {
+			dev->pool[dev->pool_nr++] = p;
+			p = NULL;
+		}
+		spin_unlock(&dev->pool_lock);
+		if (p) {
+			__scull_quantum_put(p, backend, quantum);
+			break;
+		}
+		n++;
+	}
+	t = scull_now_ns() - t;
+	spin_lock(&dev->pool_lock);
+	dev->pool_info.refilled += n;
+	dev->pool_info.refill_runs++;
+	dev->pool_info.refill_ns += t;
+	if (t > dev->pool_info.refill_ns_max)
+		dev->pool_info.refill_ns_max = t;
+	spin_unlock(&dev->pool_lock);
+}
+
+/*
+ * Memory pressure empties the pools; a device still being written
+ * fills its own again on the next miss. Reclaim may run under
+ * scull_devs_sem, so only try for it.
+ */
+static int scull_pool_shrink(int nr, gfp_t gfp_mask)
+{
+	struct scull_dev *dev;
+	void *p;
+	int i, pb, pq, left = 0;
+
+	if (down_trylock(&scull_devs_sem))
+		return nr ? -1 : 0;
+	for (i = 0; i < scull_nr_devs; i++) {
+		dev = idr_find(&scull_idr, i);
+		if (!dev || dev == SCULL_DEV_RESERVED || !dev->pool)
+			continue;
+		while (nr > 0) {
+			spin_lock(&dev->pool_lock);
+			p = dev->pool_nr ? dev->pool[--dev->pool_nr] : NULL;
+			pb = dev->pool_backend;
+			pq = dev->pool_quantum;
+			spin_unlock(&dev->pool_lock);
+			if (!p)
+				break;
+			__scull_quantum_put(p, pb, pq);
+			nr--;
+		}
+		left += dev->pool_nr;
+	}
+	up(&scull_devs_sem);
+
+	return left;
+}
+
+static void *scull_quantum_alloc(struct scull_dev *dev, int quantum)
+{
+	void *p = scull_pool_pop(dev, quantum);
+
+	if (!p)
+		p = __scull_quantum_get(dev->backend, quantum);
+	if (p)
+		dev->alloc_bytes += quantum;
+	return p;
+}
+
+static void scull_quantum_free(struct scull_dev *dev, void *p, int quantum)
+{
+	__scull_quantum_put(p, dev->backend, quantum);
+	dev->alloc_bytes -= quantum;
+}
+
+/*
+ * One slab per qset size in use, made on first use and kept until
+ * unload; objects are aligned to the cache line. The pointer array
+ * follows the node in the same object. Only a node bigger than a page
+ * whose slab order would waste more than an eighth is split: the array
+ * gets a slab of its own (1024 pointers of 8 bytes fill two pages
+ * exactly) and the node comes from scull_qhdr_cache. A device keeps
+ * the cache of its qset, so the list is only searched when the
+ * geometry changes.
+ */
+struct scull_qset_cache {
+	struct list_head list;
+	int qset;
+	kmem_cache_t *node;
+	kmem_cache_t *array;		/* NULL: array inline in node */
+	char name[24];
+};
+
+static LIST_HEAD(scull_qset_caches);
+static DECLARE_MUTEX(scull_qset_caches_sem);
+static kmem_cache_t *scull_qhdr_cache;
+
+static int scull_qset_inline(int qset)
+{
+	size_t size = L1_CACHE_ALIGN(sizeof(struct scull_qset) +
+				     qset * sizeof(void *));
+	size_t slab = PAGE_SIZE << get_order(size);
+
+	return size <= PAGE_SIZE || slab % size <= slab / 8;
+}
+
+static struct scull_qset_cache *scull_qset_cache(int qset)
+{
+	struct scull_qset_cache *c;
+	size_t arr = qset * sizeof(void *);
+
+	down(&scull_qset_caches_sem);
+	list_for_each_entry(c, &scull_qset_caches, list)
+		if (c->qset == qset)
+			goto out;
+	c = NULL;
+	if (qset <= 0)
+		goto out;
+	if (!scull_qset_inline(qset) && !scull_qhdr_cache) {
+		scull_qhdr_cache = kmem_cache_create("scull_qset",
+				sizeof(struct scull_qset), 0,
+				SLAB_HWCACHE_ALIGN, NULL, NULL);
+		if (!scull_qhdr_cache)
+			goto out;
+	}
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		goto out;
+	if (scull_qset_inline(qset)) {
+		snprintf(c->name, sizeof(c->name), "scull_qset_%d", qset);
+		c->node = kmem_cache_create(c->name,
+				sizeof(struct scull_qset) + arr, 0,
+				SLAB_HWCACHE_ALIGN, NULL, NULL);
+		c->array = NULL;
+	} else {
+		snprintf(c->name, sizeof(c->name), "scull_qptr_%d", qset);
+		c->array = kmem_cache_create(c->name, arr, 0,
+				SLAB_HWCACHE_ALIGN, NULL, NULL);
+		c->node = scull_qhdr_cache;
+	}
+	if (!c->node || (c->node == scull_qhdr_cache && !c->array)) {
+		kfree(c);
+		c = NULL;
+		goto out;
+	}
+	c->qset = qset;
+	list_add(&c->list, &scull_qset_caches);
+out:
+	up(&scull_qset_caches_sem);
+	return c;
+}
+
+static void scull_qset_caches_destroy(void)
+{
+	struct scull_qset_cache *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, &scull_qset_caches, list) {
+		list_del(&c->list);
+		if (c->array)
+			kmem_cache_destroy(c->array);
+		else
+			kmem_cache_destroy(c->node);
+		kfree(c);
+	}
+	if (scull_qhdr_cache)
+		kmem_cache_destroy(scull_qhdr_cache);
+	scull_qhdr_cache = NULL;
+}
+
+static struct scull_qset *scull_qset_alloc(struct scull_qset_cache *qc)
+{
+	struct scull_qset *dptr;
+
+	dptr = kmem_cache_alloc(qc->node, GFP_KERNEL);
+	if (!dptr)
+		return NULL;
+	memset(dptr, 0, sizeof(*dptr));
+	if (!qc->array) {
+		dptr->data = (void **)(dptr + 1);
+	} else {
+		dptr->data = kmem_cache_alloc(qc->array, GFP_KERNEL);
+		if (!dptr->data) {
+			kmem_cache_free(qc->node, dptr);
+			return NULL;
+		}
+	}
+	memset(dptr->data, 0, qc->qset * sizeof(void *));
+	return dptr;
+}
+
+static void scull_qset_free(struct scull_qset *dptr,
+			    struct scull_qset_cache *qc)
+{
+	if (qc->array)
+		kmem_cache_free(qc->array, dptr->data);
+	kmem_cache_free(qc->node, dptr);
+}
+
+/* Take up @qset entries a node, the device's lists must be empty */
+static int scull_set_qset(struct scull_dev *dev, int qset)
+{
+	struct scull_qset_cache *qc = scull_qset_cache(qset);
+
+	if (!qc)
+		return -ENOMEM;
+	dev->qc = qc;
+	dev->qset = qset;
+	return 0;
+}
+
+static void scull_free_list(struct scull_dev *dev, struct scull_qset *list,
+			    int quantum, struct scull_qset_cache *qc)
+{
 	struct scull_qset *next, *dptr;
-	int qset = dev->qset;
 	int i;
-	
-	for (dptr = dev->data; dptr; dptr = next) {
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
-		}
+
+	for (dptr = list; dptr; dptr = next) {
+		for (i = 0; i < qc->qset; i++)
+			if (dptr->data[i])
+				scull_quantum_free(dev, dptr->data[i], quantum);
+		kfree(dptr->crc);
+		kfree(dptr->dirty);
+		kfree(dptr->ref);
+		kfree(dptr->spill);
 		next = dptr->next;
-		kfree(dptr);
+		scull_qset_free(dptr, qc);
+	}
+}
+
+static u32 scull_kv_hash(const char *key, u32 klen)
+{
+	u32 hash = jhash(key, klen, 0);
+
+	/* 0 marks an empty slot */
+	return hash ? hash : 1;
+}
+
+static void scull_kv_free_entry(struct scull_dev *dev,
+				struct scull_kv_entry *e)
+{
+	int i, n = DIV_ROUND_UP(e->vlen, dev->quantum);
+
+	if (e->quanta) {
+		for (i = 0; i < n; i++)
+			if (e->quanta[i])
+				scull_quantum_free(dev, e->quanta[i], dev->quantum);
+		kfree(e->quanta);
+	}
+	kfree(e);
+}
+
+static void scull_kv_free(struct scull_dev *dev)
+{
+	struct scull_kv_table *kv = &dev->kv;
+	struct scull_kv_bucket *b, *next;
+	unsigned long i;
+	int j;
+
+	if (!kv->buckets)
+		return;
+	for (i = 0; i < kv->nbuckets; i++) {
+		for (b = &kv->buckets[i]; b; b = b->next)
+			for (j = 0; j < SCULL_KV_SLOTS; j++)
+				if (b->ent[j])
+					scull_kv_free_entry(dev, b->ent[j]);
+		for (b = kv->buckets[i].next; b; b = next) {
+			next = b->next;
+			kfree(b);
+		}
+	}
+	vfree(kv->buckets);
+	kv->buckets = NULL;
+	kv->nbuckets = 0;
+	kv->count = 0;
+}
+
+static struct scull_kv_bucket *scull_kv_alloc_buckets(unsigned long n)
+{
+	struct scull_kv_bucket *buckets;
+
+	buckets = vmalloc(n * sizeof(*buckets));
+	if (buckets)
+		memset(buckets, 0, n * sizeof(*buckets));
+	return buckets;
+}
+
+/* Put @e in a free slot of its chain, adding an overflow bucket if needed */
+static int scull_kv_link(struct scull_kv_bucket *buckets, unsigned long n,
+			 struct scull_kv_entry *e)
+{
+	struct scull_kv_bucket *b = &buckets[e->hash & (n - 1)];
+	int j;
+
+	for (;;) {
+		for (j = 0; j < SCULL_KV_SLOTS; j++) {
+			if (!b->ent[j]) {
+				b->hash[j] = e->hash;
+				b->ent[j] = e;
+				return 0;
+			}
+		}
+		if (!b->next) {
+			b->next = kmalloc(sizeof(*b), GFP_KERNEL);
+			if (!b->next)
+				return -ENOMEM;
+			memset(b->next, 0, sizeof(*b));
+		}
+		b = b->next;
+	}
+}
+
+/* Double the table once it is three quarters full */
+static int scull_kv_grow(struct scull_dev *dev)
+{
+	struct scull_kv_table *kv = &dev->kv;
+	struct scull_kv_bucket *buckets, *b, *next;
+	unsigned long i, n;
+	int j;
+
+	if (!kv->buckets) {
+		n = PAGE_SIZE / sizeof(*buckets);
+		kv->buckets = scull_kv_alloc_buckets(n);
+		if (!kv->buckets)
+			return -ENOMEM;
+		kv->nbuckets = n;
+		INIT_LIST_HEAD(&kv->lru);
+		return 0;
+	}
+	if (kv->count < kv->nbuckets * SCULL_KV_SLOTS / 4 * 3)
+		return 0;
+
+	n = kv->nbuckets * 2;
+	buckets = scull_kv_alloc_buckets(n);
+	if (!buckets)
+		return -ENOMEM;
+	for (i = 0; i < kv->nbuckets; i++)
+		for (b = &kv->buckets[i]; b; b = b->next)
+			for (j = 0; j < SCULL_KV_SLOTS; j++)
+				if (b->ent[j] && scull_kv_link(buckets, n, b->ent[j]))
+					goto nomem;
+	for (i = 0; i < kv->nbuckets; i++) {
+		for (b = kv->buckets[i].next; b; b = next) {
+			next = b->next;
+			kfree(b);
+		}
+	}
+	vfree(kv->buckets);
+	kv->buckets = buckets;
+	kv->nbuckets = n;
+	return 0;
+
+nomem:
+	for (i = 0; i < n; i++) {
+		for (b = buckets[i].next; b; b = next) {
+			next = b->next;
+			kfree(b);
+		}
+	}
+	vfree(buckets);
+	return -ENOMEM;
+}
+
+/* Find the slot holding @key, returns its bucket and sets *slot */
+static struct scull_kv_bucket *scull_kv_lookup(struct scull_dev *dev,
+					       const char *key, u32 klen,
+					       u32 hash, int *slot)
+{
+	struct scull_kv_table *kv = &dev->kv;
+	struct scull_kv_bucket *b;
+	struct scull_kv_entry *e;
+	int j;
+
+	if (!kv->buckets)
+		return NULL;
+	for (b = &kv->buckets[hash & (kv->nbuckets - 1)]; b; b = b->next) {
+		for (j = 0; j < SCULL_KV_SLOTS; j++) {
+			if (b->hash[j] != hash)
+				continue;
+			e = b->ent[j];
+			if (e->klen == klen && !memcmp(e->key, key, klen)) {
+				*slot = j;
+				return b;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void scull_kv_unlink(struct scull_dev *dev, struct scull_kv_bucket *b,
+			    int slot)
+{
+	struct scull_kv_entry *e = b->ent[slot];
+
+	b->ent[slot] = NULL;
+	b->hash[slot] = 0;
+	list_del(&e->lru);
+	dev->kv.count--;
+	scull_kv_free_entry(dev, e);
+}
+
+static void scull_kv_remove(struct scull_dev *dev, struct scull_kv_entry *e)
+{
+	struct scull_kv_bucket *b;
+	int slot;
+
+	b = scull_kv_lookup(dev, e->key, e->klen, e->hash, &slot);
+	if (b)
+		scull_kv_unlink(dev, b, slot);
+}
+
+static inline int scull_kv_expired(struct scull_kv_entry *e)
+{
+	return e->expires && time_after_eq(jiffies, e->expires);
+}
+
+/* Evict from the cold end until @need more bytes fit under the capacity */
+static int scull_kv_reclaim(struct scull_dev *dev, unsigned long need)
+{
+	struct scull_kv_table *kv = &dev->kv;
+
+	if (!dev->capacity)
+		return 0;
+	if (need > dev->capacity)
+		return -ENOSPC;
+	while (dev->alloc_bytes + need > dev->capacity) {
+		if (list_empty(&kv->lru))
+			return -ENOSPC;
+		scull_kv_remove(dev, list_entry(kv->lru.prev,
+					struct scull_kv_entry, lru));
+	}
+	return 0;
+}
+
+static int scull_kv_copy_key(struct scull_kv *req, char *key)
+{
+	if (!req->klen || req->klen > SCULL_KV_KEYMAX)
+		return -EINVAL;
+	if (copy_from_user(key, req->key, req->klen))
+		return -EFAULT;
+	return 0;
+}
+
+/* Called with dev->sem held */
+static int scull_kv_get(struct scull_dev *dev, struct scull_kv *req,
+			const char *key)
+{
+	struct scull_kv_bucket *b;
+	struct scull_kv_entry *e;
+	size_t done, n, len;
+	int slot, i;
+
+	b = scull_kv_lookup(dev, key, req->klen,
+			    scull_kv_hash(key, req->klen), &slot);
+	if (!b)
+		return -ENOENT;
+	e = b->ent[slot];
+	if (scull_kv_expired(e)) {
+		scull_kv_unlink(dev, b, slot);
+		return -ENOENT;
+	}
+	list_move(&e->lru, &dev->kv.lru);
+
+	len = min_t(size_t, req->vlen, e->vlen);
+	for (i = 0, done = 0; done < len; i++, done += n) {
+		n = min_t(size_t, len - done, dev->quantum);
+		if (copy_to_user(req->val + done, e->quanta[i], n))
+			return -EFAULT;
+	}
+	req->vlen = e->vlen;
+	return 0;
+}
+
+static int scull_kv_put(struct scull_dev *dev, struct scull_kv *req,
+			const char *key)
+{
+	struct scull_kv_bucket *b;
+	struct scull_kv_entry *e, *old = NULL;
+	unsigned long need, old_bytes = 0;
+	int i, n, slot, retval;
+	size_t done, len;
+
+	/*
+	 * A value being replaced frees its quanta: credit them, and keep
+	 * it off the lru so the room isn't made by evicting the key itself.
+	 */
+	b = scull_kv_lookup(dev, key, req->klen,
+			    scull_kv_hash(key, req->klen), &slot);
+	if (b) {
+		old = b->ent[slot];
+		old_bytes = (unsigned long)DIV_ROUND_UP(old->vlen,
+					dev->quantum) * dev->quantum;
+		list_del(&old->lru);
+	}
+	n = DIV_ROUND_UP(req->vlen, dev->quantum);
+	need = (unsigned long)n * dev->quantum;
+	retval = scull_kv_reclaim(dev, need > old_bytes ? need - old_bytes : 0);
+	if (retval)
+		goto relink;
+	retval = scull_kv_grow(dev);
+	if (retval)
+		goto relink;
+
+	retval = -ENOMEM;
+	e = kmalloc(sizeof(*e) + req->klen, GFP_KERNEL);
+	if (!e)
+		goto relink;
+	memset(e, 0, sizeof(*e));
+	e->hash = scull_kv_hash(key, req->klen);
+	e->klen = req->klen;
+	e->vlen = req->vlen;
+	memcpy(e->key, key, req->klen);
+	if (req->ttl_ms)
+		e->expires = (jiffies + msecs_to_jiffies(req->ttl_ms)) | 1;
+	e->quanta = kmalloc((n ? n : 1) * sizeof(void *), GFP_KERNEL);
+	if (!e->quanta)
+		goto nomem;
+	memset(e->quanta, 0, (n ? n : 1) * sizeof(void *));
+	for (i = 0, done = 0; i < n; i++, done += len) {
+		len = min_t(size_t, req->vlen - done, dev->quantum);
+		e->quanta[i] = scull_quantum_alloc(dev, dev->quantum);
+		if (!e->quanta[i])
+			goto nomem;
+		if (copy_from_user(e->quanta[i], req->val + done, len)) {
+			retval = -EFAULT;
+			goto fail;
+		}
+	}
+
+	b = scull_kv_lookup(dev, key, req->klen, e->hash, &slot);
+	if (b) {
+		/* replace in place, the slot keeps its hash */
+		scull_kv_free_entry(dev, b->ent[slot]);
+		b->ent[slot] = e;
+	} else {
+		retval = scull_kv_link(dev->kv.buckets, dev->kv.nbuckets, e);
+		if (retval)
+			goto fail;
+		dev->kv.count++;
+	}
+	list_add(&e->lru, &dev->kv.lru);
+	return 0;
+
+nomem:
+	retval = -ENOMEM;
+fail:
+	scull_kv_free_entry(dev, e);
+relink:
+	if (old)
+		list_add(&old->lru, &dev->kv.lru);
+	return retval;
+}
+
+static int scull_kv_ioctl(struct scull_dev *dev, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct scull_kv __user *ureq = (struct scull_kv __user *)arg;
+	struct scull_kv_batch batch;
+	struct scull_kv req;
+	struct scull_kv_bucket *b;
+	char *key;
+	u32 i;
+	int slot, retval;
+
+	key = kmalloc(SCULL_KV_KEYMAX, GFP_KERNEL);
+	if (!key)
+		return -ENOMEM;
+
+	if (cmd == SCULL_IOCKVMGET) {
+		retval = -EFAULT;
+		if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+			goto out;
+		/* the whole batch is under dev->sem, keep the hold bounded */
+		retval = -EINVAL;
+		if (batch.n > SCULL_KV_BATCH_MAX)
+			goto out;
+		retval = -ERESTARTSYS;
+		if (down_interruptible(&dev->sem))
+			goto out;
+		retval = -EINVAL;
+		if (dev->mode != SCULL_MODE_KV)
+			goto unlock;
+		/* the whole batch goes through under one lock hold */
+		for (i = 0; i < batch.n; i++) {
+			retval = -EFAULT;
+			if (copy_from_user(&req, &batch.kvs[i], sizeof(req)))
+				goto unlock;
+			req.status = scull_kv_copy_key(&req, key);
+			if (!req.status)
+				req.status = scull_kv_get(dev, &req, key);
+			if (copy_to_user(&batch.kvs[i], &req, sizeof(req)))
+				goto unlock;
+		}
+		retval = 0;
+		goto unlock;
+	}
+
+	retval = -EFAULT;
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		goto out;
+	retval = scull_kv_copy_key(&req, key);
+	if (retval)
+		goto out;
+	retval = -ERESTARTSYS;
+	if (down_interruptible(&dev->sem))
+		goto out;
+	retval = -EINVAL;
+	if (dev->mode != SCULL_MODE_KV)
+		goto unlock;
+
+	switch (cmd) {
+		case SCULL_IOCKVGET:
+			retval = scull_kv_get(dev, &req, key);
+			if (!retval && put_user(req.vlen, &ureq->vlen))
+				retval = -EFAULT;
+			break;
+
+		case SCULL_IOCKVPUT:
+			retval = scull_kv_put(dev, &req, key);
+			break;
+
+		case SCULL_IOCKVDEL:
+			b = scull_kv_lookup(dev, key, req.klen,
+					    scull_kv_hash(key, req.klen), &slot);
+			retval = -ENOENT;
+			if (b) {
+				scull_kv_unlink(dev, b, slot);
+				retval = 0;
+			}
+			break;
+	}
+unlock:
+	up(&dev->sem);
+out:
+	kfree(key);
+	return retval;
+}
+
+/* Any re-layout thread must have been stopped before this is called */
+int scull_trim(struct scull_dev *dev)
+{
+	scull_free_list(dev, dev->data, dev->quantum, dev->qc);
+	scull_free_list(dev, dev->mig_old, dev->quantum, dev->qc);
+	scull_free_list(dev, dev->mig_data, dev->mig_quantum, dev->mig_qc);
+	
+	dev->size = 0;
+	dev->start = 0;
+	/* a delta can't express a trim */
+	dev->ckpt_need_base = 1;
+	scull_pool_drain(dev, dev->backend, dev->quantum);
+	vfree(dev->recs);
+	dev->recs = NULL;
+	dev->nr_recs = 0;
+	dev->max_recs = 0;
+	scull_kv_free(dev);
+	vfree(dev->flat);
+	dev->flat = NULL;
+	dev->sealed = 0;
+	if (!dev->pinned) {
+		dev->quantum = scull_quantum;
+		/* without a slab for it, the old qset stays */
+		scull_set_qset(dev, scull_qset);
+	}
+	if (dev->mode == SCULL_MODE_RING)
+		dev->ring_quanta = DIV_ROUND_UP(dev->capacity, dev->quantum);
+	dev->data = NULL;
+	dev->mig_old = NULL;
+	dev->mig_data = NULL;
+	dev->migrating = 0;
+	/* every tier slot went with the nodes */
+	if (dev->tier_map)
+		memset(dev->tier_map, 0,
+		       BITS_TO_LONGS(dev->tier_nslots) * sizeof(long));
+	dev->tier_hand = NULL;
+	dev->tier.spilled = 0;
+	
+	return 0;
+	
+}
+
+struct scull_qset* scull_follow(struct scull_qset **head, long item,
+			       struct scull_qset_cache *qc, int create)
+{
+	struct scull_qset **pptr = head;
+
+	for (;;) {
+		if (!*pptr) {
+			if (!create)
+				return NULL;
+			*pptr = scull_qset_alloc(qc);
+			if (!*pptr)
+				return NULL;
+		}
+		if (item-- == 0)
+			return *pptr;
+		pptr = &(*pptr)->next;
+	}
+}
+
+/*
+ * A ring device keeps logical offsets growing forever, quantum k of the
+ * stream lives in slot k % ring_quanta.
+ */
+static inline unsigned long scull_ring_slot(struct scull_dev *dev,
+					    unsigned long pos)
+{
+	unsigned long k = pos / dev->quantum;
+
+	return (k % dev->ring_quanta) * dev->quantum + pos % dev->quantum;
+}
+
+/*
+ * Make room for a write at @pos: once the stream reaches past the ring,
+ * the oldest quantum is handed over in place, no free and no allocation.
+ */
+static void scull_ring_advance(struct scull_dev *dev, unsigned long pos)
+{
+	unsigned long k = pos / dev->quantum;
+	unsigned long start;
+
+	if (k < dev->ring_quanta)
+		return;
+	start = (k - dev->ring_quanta + 1) * dev->quantum;
+	if (start > dev->start)
+		dev->start = start;
+}
+
+/* Checksum every quantum of a node; no memory means it goes unchecked */
+static void scull_crc_fill(struct scull_qset *dptr, int quantum, int qset)
+{
+	int i;
+
+	/* what is in the tier file can't be checksummed from here */
+	for (i = 0; dptr->spill && i < qset; i++)
+		if (dptr->spill[i])
+			return;
+	dptr->crc = kmalloc(qset * sizeof(u32), GFP_KERNEL);
+	if (!dptr->crc)
+		return;
+	for (i = 0; i < qset; i++)
+		if (dptr->data[i])
+			dptr->crc[i] = crc32c(~0, dptr->data[i], quantum);
+}
+
+static void scull_crc_list(struct scull_qset *dptr, int quantum, int qset,
+			   int on)
+{
+	for (; dptr; dptr = dptr->next) {
+		kfree(dptr->crc);
+		dptr->crc = NULL;
+		if (on)
+			scull_crc_fill(dptr, quantum, qset);
+	}
+}
+
+static ssize_t scull_kernel_rw(struct file *file, char *buf, size_t len,
+			       loff_t *pos, int write)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t retval;
+
+	set_fs(KERNEL_DS);
+	if (write)
+		retval = vfs_write(file, (const char __user *)buf, len, pos);
+	else
+		retval = vfs_read(file, (char __user *)buf, len, pos);
+	set_fs(old_fs);
+	return retval;
+}
+
+/*
+ * Tiering. With a RAM budget set, quanta over it are written to a
+ * per-device file and freed, the node keeps the file slot they went
+ * to and the next lookup reads them back in. Victims come from a clock
+ * over dev->data: a lookup sets the reference bit of its quantum, the
+ * hand clears set bits and evicts the first quantum found clear.
+ */
+static int scull_tier_slot(struct scull_dev *dev, unsigned long *slotp)
+{
+	unsigned long slot = dev->tier_nslots, n, *map;
+
+	if (dev->tier_map)
+		slot = find_first_zero_bit(dev->tier_map, dev->tier_nslots);
+	if (slot >= dev->tier_nslots) {
+		n = dev->tier_nslots ? dev->tier_nslots * 2 : BITS_PER_LONG;
+		map = vmalloc(BITS_TO_LONGS(n) * sizeof(long));
+		if (!map)
+			return -ENOMEM;
+		memset(map, 0, BITS_TO_LONGS(n) * sizeof(long));
+		if (dev->tier_map)
+			memcpy(map, dev->tier_map,
+			       BITS_TO_LONGS(dev->tier_nslots) * sizeof(long));
+		vfree(dev->tier_map);
+		dev->tier_map = map;
+		slot = dev->tier_nslots;
+		dev->tier_nslots = n;
+	}
+	__set_bit(slot, dev->tier_map);
+	*slotp = slot;
+	return 0;
+}
+
+/* Write quantum @i of @dptr to the tier file and free it */
+static int scull_tier_evict(struct scull_dev *dev, struct scull_qset *dptr,
+			    int i)
+{
+	unsigned long slot;
+	loff_t pos;
+	int retval;
+
+	if (!dptr->spill) {
+		dptr->spill = kmalloc(dev->qset * sizeof(u32), GFP_KERNEL);
+		if (!dptr->spill)
+			return -ENOMEM;
+		memset(dptr->spill, 0, dev->qset * sizeof(u32));
+	}
+	retval = scull_tier_slot(dev, &slot);
+	if (retval)
+		return retval;
+	pos = (loff_t)slot * dev->quantum;
+	if (scull_kernel_rw(dev->tier_file, dptr->data[i], dev->quantum,
+			    &pos, 1) != dev->quantum) {
+		__clear_bit(slot, dev->tier_map);
+		return -EIO;
+	}
+	dptr->spill[i] = slot + 1;
+	scull_quantum_free(dev, dptr->data[i], dev->quantum);
+	dptr->data[i] = NULL;
+	dev->tier.evictions++;
+	dev->tier.spilled += dev->quantum;
+	return 0;
+}
+
+/*
+ * Move the clock hand on to the next quantum not referenced since the
+ * last sweep and spill it. Two full turns without a victim means there
+ * is nothing left in RAM.
+ */
+static int scull_tier_evict_one(struct scull_dev *dev)
+{
+	struct scull_qset *dptr = dev->tier_hand;
+	int i = dev->tier_hand_pos, turns = 0;
+
+	while (turns < 3) {
+		if (!dptr) {
+			dptr = dev->data;
+			i = 0;
+			turns++;
+			continue;
+		}
+		if (i >= dev->qset) {
+			dptr = dptr->next;
+			i = 0;
+			continue;
+		}
+		if (dptr->data[i] &&
+		    !(dptr->ref && test_and_clear_bit(i, dptr->ref))) {
+			dev->tier_hand = dptr;
+			dev->tier_hand_pos = i + 1;
+			return scull_tier_evict(dev, dptr, i);
+		}
+		i++;
+	}
+	dev->tier_hand = NULL;
+	return -ENOMEM;
+}
+
+/* Get under the budget by one quantum; if nothing can go, run over it */
+static void scull_tier_room(struct scull_dev *dev)
+{
+	while (dev->alloc_bytes + dev->quantum > dev->tier_budget)
+		if (scull_tier_evict_one(dev))
+			break;
+}
+
+/* Read spilled quantum @i of @dptr back in */
+static void *scull_tier_fault(struct scull_dev *dev, struct scull_qset *dptr,
+			      int i)
+{
+	unsigned long slot = dptr->spill[i] - 1;
+	loff_t pos = (loff_t)slot * dev->quantum;
+	u64 t = scull_now_ns();
+	void *p;
+
+	if (dev->tier_budget)
+		scull_tier_room(dev);
+	p = scull_quantum_alloc(dev, dev->quantum);
+	if (!p)
+		return NULL;
+	if (scull_kernel_rw(dev->tier_file, p, dev->quantum, &pos, 0) !=
+	    dev->quantum) {
+		scull_quantum_free(dev, p, dev->quantum);
+		return NULL;
+	}
+	__clear_bit(slot, dev->tier_map);
+	dptr->spill[i] = 0;
+	dptr->data[i] = p;
+	dev->tier.spilled -= dev->quantum;
+	dev->tier.faults++;
+	t = scull_now_ns() - t;
+	dev->tier.fault_ns += t;
+	if (t > dev->tier.fault_ns_max)
+		dev->tier.fault_ns_max = t;
+	return p;
+}
+
+/* A lookup hit quantum @i of @dptr; no bitmap just makes it look cold */
+static void scull_tier_ref(struct scull_dev *dev, struct scull_qset *dptr,
+			   int i)
+{
+	if (!dptr->ref) {
+		dptr->ref = kmalloc(BITS_TO_LONGS(dev->qset) * sizeof(long),
+				    GFP_KERNEL);
+		if (!dptr->ref)
+			return;
+		memset(dptr->ref, 0, BITS_TO_LONGS(dev->qset) * sizeof(long));
+	}
+	__set_bit(i, dptr->ref);
+}
+
+static int scull_tier_open(struct scull_dev *dev)
+{
+	char *path;
+
+	if (!scull_tier_path || !*scull_tier_path)
+		return -ENOENT;
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	snprintf(path, PATH_MAX, "%s%d", scull_tier_path, dev->index);
+	dev->tier_file = filp_open(path, O_RDWR | O_CREAT | O_TRUNC |
+				   O_LARGEFILE, 0600);
+	kfree(path);
+	if (IS_ERR(dev->tier_file)) {
+		int retval = PTR_ERR(dev->tier_file);
+
+		dev->tier_file = NULL;
+		return retval;
+	}
+	return 0;
+}
+
+/* Nothing may be spilled any more */
+static void scull_tier_close(struct scull_dev *dev)
+{
+	if (dev->tier_file)
+		filp_close(dev->tier_file, NULL);
+	dev->tier_file = NULL;
+	vfree(dev->tier_map);
+	dev->tier_map = NULL;
+	dev->tier_nslots = 0;
+	dev->tier_hand = NULL;
+}
+
+/*
+ * Find the byte at @pos in the layout starting at @head. *room is set to
+ * the number of bytes reachable from there inside the same quantum.
+ * NULL means a hole, or out of memory when @create is set.
+ */
+static char *__scull_locate(struct scull_dev *dev, struct scull_qset **head,
+			    int quantum, struct scull_qset_cache *qc,
+			    unsigned long pos, size_t *room, int create,
+			    struct scull_slot *slot)
+{
+	struct scull_qset *dptr;
+	int qset = qc->qset;
+	unsigned long itemsize = (unsigned long)quantum * qset;
+	long item = pos / itemsize;
+	unsigned long rest = pos % itemsize;
+	int s_pos = rest / quantum;
+	int q_pos = rest % quantum;
+
+	*room = quantum - q_pos;
+	dptr = scull_follow(head, item, qc, create);
+	if (!dptr)
+		return NULL;
+	if (!dptr->data[s_pos]) {
+		if (dptr->spill && dptr->spill[s_pos]) {
+			if (!scull_tier_fault(dev, dptr, s_pos))
+				return NULL;
+		} else {
+			if (!create)
+				return NULL;
+			if (dev->tier_budget)
+				scull_tier_room(dev);
+			dptr->data[s_pos] = scull_quantum_alloc(dev, quantum);
+			if (!dptr->data[s_pos])
+				return NULL;
+		}
+	} else if (dev->tier_budget) {
+		dev->tier.hits++;
+	}
+	if (dev->tier_budget)
+		scull_tier_ref(dev, dptr, s_pos);
+	/* the lock-free sealed path must not allocate or publish */
+	if (dev->crc_on && !dptr->crc && (create || !dev->sealed))
+		scull_crc_fill(dptr, quantum, qset);
+	if (slot) {
+		slot->dptr = dptr;
+		slot->s_pos = s_pos;
+		slot->quantum = quantum;
+	}
+	return (char *)dptr->data[s_pos] + q_pos;
+}
+
+/*
+ * Same thing for the device as a whole, called with dev->sem held or on
+ * a sealed device. While a re-layout is running, everything below
+ * mig_pos already lives in the new layout and everything above it still
+ * lives in the old one.
+ */
+static char *scull_locate_slot(struct scull_dev *dev, unsigned long pos,
+			       size_t *room, int create, struct scull_slot *slot)
+{
+	char *ptr;
+
+	if (slot)
+		slot->dptr = NULL;
+	if (dev->flat) {
+		*room = 0;
+		if (pos < dev->flat_base || pos >= dev->size)
+			return NULL;
+		*room = dev->size - pos;
+		return dev->flat + (pos - dev->flat_base);
+	}
+	if (dev->mode == SCULL_MODE_RING)
+		pos = scull_ring_slot(dev, pos);
+	if (dev->migrating && pos < dev->mig_pos) {
+		ptr = __scull_locate(dev, &dev->mig_data, dev->mig_quantum,
+				     dev->mig_qc, pos, room, create, slot);
+		if (*room > dev->mig_pos - pos)
+			*room = dev->mig_pos - pos;
+		return ptr;
+	}
+	return __scull_locate(dev, &dev->data, dev->quantum, dev->qc,
+			      pos, room, create, slot);
+}
+
+static inline char *scull_locate(struct scull_dev *dev, unsigned long pos,
+				 size_t *room, int create)
+{
+	return scull_locate_slot(dev, pos, room, create, NULL);
+}
+
+/*
+ * crc32c() from lib/libcrc32c is a plain table-driven loop in this
+ * kernel; it doesn't go through the crypto API and uses no CPU CRC
+ * instructions.  A crypto_hash transform would need a scatterlist,
+ * which vmalloc-backed quanta can't give it directly.
+ */
+static inline u32 scull_crc(struct scull_slot *slot)
+{
+	return crc32c(~0, slot->dptr->data[slot->s_pos], slot->quantum);
+}
+
+/*
+ * Bookkeeping after a quantum has been written to, with dev->sem held.
+ * The checksum always covers the whole quantum.
+ */
+static void scull_touched(struct scull_dev *dev, struct scull_slot *slot)
+{
+	struct scull_qset *dptr = slot->dptr;
+
+	if (!dptr)
+		return;
+	if (dev->crc_on && dptr->crc)
+		dptr->crc[slot->s_pos] = scull_crc(slot);
+	if (dev->dirty_track && !dev->migrating) {
+		if (!dptr->dirty) {
+			dptr->dirty = kmalloc(BITS_TO_LONGS(dev->qset) *
+					      sizeof(long), GFP_KERNEL);
+			if (!dptr->dirty) {
+				dev->ckpt_need_base = 1;
+				return;
+			}
+			memset(dptr->dirty, 0,
+			       BITS_TO_LONGS(dev->qset) * sizeof(long));
+		}
+		if (!test_and_set_bit(slot->s_pos, dptr->dirty))
+			dptr->ndirty++;
+	}
+}
+
+/* Nonzero if the quantum no longer matches its checksum */
+static int scull_crc_bad(struct scull_dev *dev, struct scull_slot *slot)
+{
+	if (!dev->crc_on || !slot->dptr || !slot->dptr->crc)
+		return 0;
+	return slot->dptr->crc[slot->s_pos] != scull_crc(slot);
+}
+
+/* Free quantum number @k of the old layout */
+static void scull_drop_quantum(struct scull_dev *dev, unsigned long k)
+{
+	struct scull_qset *dptr;
+	int s_pos = k % dev->qset;
+
+	dptr = scull_follow(&dev->data, k / dev->qset, dev->qc, 0);
+	if (!dptr)
+		return;
+	if (dptr->data[s_pos]) {
+		scull_quantum_free(dev, dptr->data[s_pos], dev->quantum);
+		dptr->data[s_pos] = NULL;
+	}
+	if (s_pos == dev->qset - 1) {
+		kfree(dptr->crc);
+		dptr->crc = NULL;
+		kfree(dptr->dirty);
+		dptr->dirty = NULL;
+	}
+}
+
+/*
+ * Move one quantum of the new layout over from the old one. Each step
+ * takes dev->sem for a single quantum copy, so readers and writers are
+ * never held off for longer than that. Once everything is over, the old
+ * nodes are taken off dev->data and freed one per step; a write past
+ * the end meanwhile just starts a fresh old list. Returns 1 once the
+ * old layout is empty and has been swapped out.
+ */
+static int scull_migrate_step(struct scull_dev *dev)
+{
+	int nq = dev->mig_quantum;
+	int oq = dev->quantum;
+	unsigned long pos, end, k;
+	size_t room, done;
+	char *src, *dst = NULL;
+	struct scull_slot slot;
+	struct scull_qset *dptr;
+
+	down(&dev->sem);
+	pos = dev->mig_pos;
+	if (pos >= dev->size && (dev->mig_old || dev->data)) {
+		if (dev->mig_old) {
+			dptr = dev->mig_old;
+			dev->mig_old = dptr->next;
+			dptr->next = NULL;
+			scull_free_list(dev, dptr, dev->quantum, dev->qc);
+		} else {
+			dev->mig_old = dev->data;
+			dev->data = NULL;
+		}
+		up(&dev->sem);
+		return 0;
+	}
+	if (pos >= dev->size) {
+		dev->data = dev->mig_data;
+		dev->quantum = dev->mig_quantum;
+		dev->qset = dev->mig_qset;
+		dev->qc = dev->mig_qc;
+		dev->mig_data = NULL;
+		dev->migrating = 0;
+		up(&dev->sem);
+		return 1;
+	}
+
+	end = min(pos + nq, dev->size);
+	for (done = 0; pos + done < end; done += room) {
+		src = __scull_locate(dev, &dev->data, oq, dev->qc,
+				     pos + done, &room, 0, NULL);
+		if (room > end - pos - done)
+			room = end - pos - done;
+		if (!src)
+			continue;
+		if (!dst) {
+			size_t nroom;
+
+			dst = __scull_locate(dev, &dev->mig_data, nq,
+					     dev->mig_qc, pos, &nroom, 1, &slot);
+			if (!dst) {
+				up(&dev->sem);
+				return -ENOMEM;
+			}
+			memset(dst, 0, nq);
+		}
+		memcpy(dst + done, src, room);
+	}
+	if (dst)
+		scull_touched(dev, &slot);
+
+	/* old quanta lying entirely below the new cursor are dead now */
+	for (k = pos / oq; (k + 1) * oq <= end; k++)
+		scull_drop_quantum(dev, k);
+	dev->mig_pos = pos + nq;
+	up(&dev->sem);
+	return 0;
+}
+
+static int scull_migrate_thread(void *data)
+{
+	struct scull_dev *dev = data;
+	int ret;
+
+	/* step() takes dev->sem, which orders mig_stop for us */
+	while (!dev->mig_stop) {
+		ret = scull_migrate_step(dev);
+		if (ret > 0)
+			break;
+		if (ret < 0)
+			msleep(10);
+		cond_resched();
+	}
+
+	/* exits right away; kthread_stop() would wait forever on that */
+	complete_and_exit(&dev->mig_done, 0);
+}
+
+/*
+ * Collect a finished re-layout thread, called with dev->sem held. It
+ * cleared dev->migrating on its way out, so the wait is short.
+ */
+static void scull_migrate_reap(struct scull_dev *dev)
+{
+	if (dev->mig_task && !dev->migrating) {
+		wait_for_completion(&dev->mig_done);
+		dev->mig_task = NULL;
+	}
+}
+
+/*
+ * Stop a re-layout wherever it is. The data is left split between the
+ * two layouts, so this is only good right before scull_trim().
+ */
+static void scull_migrate_abort(struct scull_dev *dev)
+{
+	if (dev->mig_task) {
+		dev->mig_stop = 1;
+		wait_for_completion(&dev->mig_done);
+		dev->mig_task = NULL;
+	}
+}
+
+/* Also checks what an image file claims, so nothing is taken on trust */
+static int scull_geometry_valid(struct scull_dev *dev, long quantum, long qset)
+{
+	if (quantum <= 0 || quantum > INT_MAX ||
+	    qset <= 0 || qset > INT_MAX / sizeof(void *))
+		return 0;
+	/* page blocks come in powers of two */
+	if (dev->backend == SCULL_BACKEND_PAGES &&
+	    quantum != PAGE_SIZE << get_order(quantum))
+		return 0;
+	return 1;
+}
+
+/* Switch @dev to a new geometry, called with dev->sem held */
+static int __scull_set_geometry(struct scull_dev *dev, int quantum, int qset)
+{
+	struct scull_qset_cache *qc;
+	struct task_struct *task;
+
+	if (dev->sealed)
+		return -EPERM;
+	scull_migrate_reap(dev);
+	if (dev->migrating)
+		return -EBUSY;
+	/* a ring can't be re-laid out, its slots are tied to the quantum */
+	if (dev->mode != SCULL_MODE_PLAIN && dev->size)
+		return -EBUSY;
+	/* nor a key-value store, whose size stays 0 however full it is */
+	if (dev->mode == SCULL_MODE_KV && dev->kv.count)
+		return -EBUSY;
+	/* nor can quanta sitting in the tier file */
+	if (dev->tier_budget)
+		return -EBUSY;
+	if (!scull_geometry_valid(dev, quantum, qset))
+		return -EINVAL;
+
+	qc = scull_qset_cache(qset);
+	if (!qc)
+		return -ENOMEM;
+
+	dev->pinned = 1;
+	if (quantum == dev->quantum && qset == dev->qset)
+		return 0;
+	if (!dev->size) {
+		scull_trim(dev);
+		dev->quantum = quantum;
+		dev->qset = qset;
+		dev->qc = qc;
+		if (dev->mode == SCULL_MODE_RING)
+			dev->ring_quanta = DIV_ROUND_UP(dev->capacity, quantum);
+		return 0;
+	}
+
+	dev->mig_data = NULL;
+	dev->mig_quantum = quantum;
+	dev->mig_qset = qset;
+	dev->mig_qc = qc;
+	dev->mig_pos = 0;
+	dev->mig_stop = 0;
+	init_completion(&dev->mig_done);
+	dev->migrating = 1;
+	/* the dirty bits belong to the old layout */
+	dev->ckpt_need_base = 1;
+	task = kthread_run(scull_migrate_thread, dev, "scull_migrate");
+	if (IS_ERR(task)) {
+		dev->migrating = 0;
+		return PTR_ERR(task);
+	}
+	dev->mig_task = task;
+	return 0;
+}
+
+static int scull_set_geometry(struct scull_dev *dev, struct scull_geom *geom)
+{
+	int retval;
+
+	if (geom->quantum <= 0 || geom->qset <= 0)
+		return -EINVAL;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	retval = __scull_set_geometry(dev, geom->quantum, geom->qset);
+	up(&dev->sem);
+	return retval;
+}
+
+typedef int (*scull_walk_fn)(struct scull_dev *dev, unsigned long off,
+			     char *ptr, size_t len, void *arg);
+
+static int __scull_walk(struct scull_dev *dev, struct scull_qset *dptr,
+			int quantum, int qset, unsigned long lo,
+			unsigned long hi, scull_walk_fn fn, void *arg)
+{
+	unsigned long off, end;
+	int i, retval;
+
+	for (off = 0; dptr && off < hi; dptr = dptr->next) {
+		for (i = 0; i < qset && off < hi; i++, off += quantum) {
+			end = off + quantum;
+			if (end <= lo)
+				continue;
+			/* in the tier file: populated, but left where it is */
+			if (!dptr->data[i] && dptr->spill && dptr->spill[i])
+				retval = fn(dev, max(off, lo), NULL,
+					    end - max(off, lo), arg);
+			else if (!dptr->data[i])
+				continue;
+			else if (off < lo)
+				retval = fn(dev, lo, (char *)dptr->data[i] + (lo - off),
+					    end - lo, arg);
+			else
+				retval = fn(dev, off, dptr->data[i], quantum, arg);
+			if (retval)
+				return retval;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Call @fn on every allocated quantum in offset order, with dev->sem
+ * held. A nonzero return from @fn stops the walk and is passed back.
+ * A quantum in the tier file is not read back in, @fn gets a NULL ptr.
+ */
+static int scull_walk(struct scull_dev *dev, scull_walk_fn fn, void *arg)
+{
+	unsigned long k, first, off;
+	size_t room;
+	char *ptr;
+	int retval;
+
+	if (dev->flat) {
+		for (off = dev->flat_base; off < dev->size; off += room) {
+			room = min_t(unsigned long, dev->size - off,
+				     dev->quantum - off % dev->quantum);
+			retval = fn(dev, off, dev->flat + (off - dev->flat_base),
+				    room, arg);
+			if (retval)
+				return retval;
+		}
+		return 0;
+	}
+	if (dev->mode == SCULL_MODE_RING) {
+		first = dev->start / dev->quantum;
+		for (k = first; k * dev->quantum < dev->size; k++) {
+			off = max(k * dev->quantum, dev->start);
+			ptr = scull_locate(dev, off, &room, 0);
+			if (!ptr)
+				continue;
+			retval = fn(dev, off, ptr, room, arg);
+			if (retval)
+				return retval;
+		}
+		return 0;
+	}
+	if (!dev->migrating)
+		return __scull_walk(dev, dev->data, dev->quantum, dev->qset,
+				    0, ULONG_MAX, fn, arg);
+	retval = __scull_walk(dev, dev->mig_data, dev->mig_quantum,
+			      dev->mig_qset, 0, dev->mig_pos, fn, arg);
+	if (retval)
+		return retval;
+	return __scull_walk(dev, dev->data, dev->quantum, dev->qset,
+			    dev->mig_pos, ULONG_MAX, fn, arg);
+}
+
+static int scull_adapt_pick(struct scull_adapt *ad)
+{
+	unsigned int seen = 0;
+	int b, q;
+
+	for (b = 0; b < SCULL_HIST_BUCKETS - 1; b++) {
+		seen += ad->win_hist[b];
+		if (seen * 2 >= ad->win_writes)
+			break;
+	}
+	/* the median write is below 2^(b + 1) */
+	if (ad->win_seq * 4 >= ad->win_writes * 3)
+		q = max(1 << min(b + 1 + SCULL_ADAPT_STREAM_SHIFT, 30),
+			SCULL_ADAPT_STREAM_MIN);
+	else
+		q = 1 << (b + 1);
+	if (q < SCULL_ADAPT_MIN)
+		q = SCULL_ADAPT_MIN;
+	if (q > SCULL_ADAPT_MAX)
+		q = SCULL_ADAPT_MAX;
+	return q;
+}
+
+/*
+ * Called from scull_write() with dev->sem held. The quantum can only
+ * change for the device as a whole, so a new size class is applied
+ * with a background re-layout once two windows in a row agree on it.
+ */
+static void scull_adapt_note(struct scull_dev *dev, unsigned long pos,
+			     size_t count, size_t done, u64 ns)
+{
+	struct scull_adapt *ad = &dev->adapt;
+	int b, qb, q;
+
+	/* fls(0) - 1 is no bucket, and an empty write says nothing */
+	if (!count)
+		return;
+	/* fls() would cut a 64-bit count down to its low word */
+	b = min(fls64(count) - 1, SCULL_HIST_BUCKETS - 1);
+	qb = min(fls(dev->quantum) - 1, SCULL_HIST_BUCKETS - 1);
+
+	ad->hist[b]++;
+	ad->tp_bytes[qb] += done;
+	ad->tp_ns[qb] += ns;
+	if (pos == ad->last_end) {
+		ad->seq++;
+		ad->win_seq++;
+	} else {
+		ad->rand++;
+	}
+	/* a short write is continued by the caller, count it as one */
+	ad->last_end = pos + done;
+	if (done < count)
+		return;
+	ad->win_hist[b]++;
+	if (++ad->win_writes < SCULL_ADAPT_WINDOW)
+		return;
+
+	if (ad->enabled && !dev->migrating && dev->mode == SCULL_MODE_PLAIN) {
+		q = scull_adapt_pick(ad);
+		if (q == dev->quantum) {
+			ad->pending = 0;
+		} else if (q != ad->pending) {
+			ad->pending = q;
+		} else if (time_after_eq(jiffies, ad->next)) {
+			if (!__scull_set_geometry(dev, q, dev->qset))
+				ad->relayouts++;
+			ad->pending = 0;
+			ad->next = jiffies + SCULL_ADAPT_HOLDOFF;
+		}
+	}
+	ad->win_writes = 0;
+	ad->win_seq = 0;
+	memset(ad->win_hist, 0, sizeof(ad->win_hist));
+}
+
+struct scull_adapt_walk {
+	unsigned long fixed_last;
+	unsigned long fixed_quanta;
+	unsigned long quanta;
+};
+
+static int scull_adapt_count(struct scull_dev *dev, unsigned long off,
+			     char *ptr, size_t len, void *arg)
+{
+	struct scull_adapt_walk *w = arg;
+	unsigned long first = off / scull_quantum;
+	unsigned long last = (off + len - 1) / scull_quantum;
+
+	/* quanta the fixed global size would have needed for the same data */
+	if (w->fixed_quanta && first <= w->fixed_last)
+		first = w->fixed_last + 1;
+	if (first <= last) {
+		w->fixed_quanta += last - first + 1;
+		w->fixed_last = last;
+	}
+	w->quanta++;
+	return 0;
+}
+
+static int scull_adapt_report(struct scull_dev *dev,
+			      struct scull_adapt_info __user *uinfo)
+{
+	struct scull_adapt_info *info;
+	struct scull_adapt_walk w;
+	struct scull_qset *dptr;
+	int i, retval = 0;
+
+	info = kmalloc(sizeof(*info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+	memset(info, 0, sizeof(*info));
+	memset(&w, 0, sizeof(w));
+
+	if (down_interruptible(&dev->sem)) {
+		kfree(info);
+		return -ERESTARTSYS;
+	}
+	scull_walk(dev, scull_adapt_count, &w);
+	for (dptr = dev->data; dptr; dptr = dptr->next)
+		info->meta_bytes += sizeof(*dptr) + dev->qset * sizeof(void *);
+	info->enabled = dev->adapt.enabled;
+	info->quantum = dev->migrating ? dev->mig_quantum : dev->quantum;
+	info->fixed_quantum = scull_quantum;
+	info->size = dev->size;
+	info->alloc_bytes = dev->alloc_bytes;
+	info->fixed_alloc_bytes = (u64)w.fixed_quanta * scull_quantum;
+	info->seq_writes = dev->adapt.seq;
+	info->rand_writes = dev->adapt.rand;
+	info->relayouts = dev->adapt.relayouts;
+	for (i = 0; i < SCULL_HIST_BUCKETS; i++) {
+		info->hist[i] = dev->adapt.hist[i];
+		info->tp_bytes[i] = dev->adapt.tp_bytes[i];
+		info->tp_ns[i] = dev->adapt.tp_ns[i];
+	}
+	up(&dev->sem);
+
+	if (copy_to_user(uinfo, info, sizeof(*info)))
+		retval = -EFAULT;
+	kfree(info);
+	return retval;
+}
+
+/* Make room for one more index entry, called with dev->sem held */
+static int scull_log_reserve(struct scull_dev *dev)
+{
+	struct scull_rec *recs;
+	unsigned long max;
+
+	if (dev->nr_recs < dev->max_recs)
+		return 0;
+	max = dev->max_recs ? dev->max_recs * 2 : PAGE_SIZE / sizeof(*recs);
+	recs = vmalloc(max * sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+	if (dev->recs) {
+		memcpy(recs, dev->recs, dev->nr_recs * sizeof(*recs));
+		vfree(dev->recs);
+	}
+	dev->recs = recs;
+	dev->max_recs = max;
+	return 0;
+}
+
+/*
+ * A log write is one record, so it is stored whole instead of one
+ * quantum at a time. The size only moves, and the record only shows up
+ * in the index, once all of it is in. Called with dev->sem held.
+ */
+static ssize_t scull_log_write(struct scull_dev *dev, const char __user *buf,
+			       size_t count, loff_t *f_pos)
+{
+	unsigned long off = dev->size;
+	struct scull_rec *rec;
+	struct scull_slot slot;
+	size_t room, done, n;
+	u64 now;
+	char *ptr;
+
+	if (!count)
+		return 0;
+	if (scull_log_reserve(dev))
+		return -ENOMEM;
+	for (done = 0; done < count; done += n) {
+		ptr = scull_locate_slot(dev, off + done, &room, 1, &slot);
+		if (!ptr)
+			return -ENOMEM;
+		n = min(count - done, room);
+		if (copy_from_user(ptr, buf + done, n))
+			return -EFAULT;
+		scull_touched(dev, &slot);
+	}
+
+	now = scull_now_ns();
+	rec = &dev->recs[dev->nr_recs];
+	if (dev->nr_recs && now < rec[-1].ts)
+		now = rec[-1].ts;
+	rec->off = off;
+	rec->ts = now;
+	dev->nr_recs++;
+	dev->size = off + count;
+	*f_pos = dev->size;
+	return count;
+}
+
+/* Index of the first record with ts >= @ts, nr_recs if there is none */
+static unsigned long scull_log_find_time(struct scull_dev *dev, u64 ts)
+{
+	unsigned long lo = 0, hi = dev->nr_recs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dev->recs[mid].ts < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int scull_log_seek(struct scull_dev *dev, struct file *filp,
+			  struct scull_logseek __user *useek)
+{
+	struct scull_logseek ls;
+	unsigned long n;
+	int retval;
+
+	if (copy_from_user(&ls, useek, sizeof(ls)))
+		return -EFAULT;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	retval = -EINVAL;
+	if (dev->mode != SCULL_MODE_LOG)
+		goto out;
+	if (!ls.by_time)
+		n = ls.key < dev->nr_recs ? ls.key : dev->nr_recs;
+	else
+		n = scull_log_find_time(dev, ls.key);
+	retval = -ENXIO;
+	if (n >= dev->nr_recs)
+		goto out;
+	ls.off = dev->recs[n].off;
+	filp->f_pos = ls.off;
+	retval = 0;
+out:
+	up(&dev->sem);
+	if (retval == 0 && copy_to_user(useek, &ls, sizeof(ls)))
+		retval = -EFAULT;
+	return retval;
+}
+
+/* Nonzero if the quantum holding @pos is in the tier file */
+static int scull_in_tier(struct scull_dev *dev, unsigned long pos)
+{
+	unsigned long itemsize = (unsigned long)dev->quantum * dev->qset;
+	int s_pos = (pos % itemsize) / dev->quantum;
+	struct scull_qset *dptr;
+
+	if (!dev->tier_budget || dev->migrating)
+		return 0;
+	dptr = scull_follow(&dev->data, pos / itemsize, dev->qc, 0);
+	return dptr && !dptr->data[s_pos] && dptr->spill && dptr->spill[s_pos];
+}
+
+/*
+ * The scrubber checks one quantum per lock hold, spreading scrub_rate
+ * quanta over each second at the lowest priority.
+ */
+static int scull_scrub_thread(void *data)
+{
+	struct scull_dev *dev = data;
+	struct scull_slot slot;
+	unsigned long pos;
+	size_t room;
+	int rate, i, batch;
+	long delay;
+	u64 t;
+
+	set_user_nice(current, 19);
+	while (!kthread_should_stop()) {
+		rate = dev->scrub_rate;
+		batch = rate >= HZ ? rate / HZ : 1;
+		delay = rate >= HZ ? 1 : HZ / max(rate, 1);
+		for (i = 0; i < batch; i++) {
+			down(&dev->sem);
+			if (dev->scrub_pos < dev->start ||
+			    dev->scrub_pos >= dev->size)
+				dev->scrub_pos = dev->start;
+			pos = dev->scrub_pos;
+			room = dev->quantum;
+			/* spilled quanta have no crc, don't fault them in */
+			if (pos < dev->size && !scull_in_tier(dev, pos) &&
+			    scull_locate_slot(dev, pos, &room, 0, &slot) &&
+			    slot.dptr && slot.dptr->crc) {
+				t = scull_now_ns();
+				if (scull_crc_bad(dev, &slot)) {
+					/* it is found again every pass */
+					dev->scrub.scrub_errors++;
+					if (printk_ratelimit())
+						printk(KERN_WARNING
+						       "scull: scrub found "
+						       "crc mismatch at %lu\n",
+						       pos);
+				}
+				dev->scrub.ns += scull_now_ns() - t;
+				dev->scrub.scanned++;
+				dev->scrub.bytes += slot.quantum;
+			}
+			dev->scrub_pos = pos + (room ? room : dev->quantum);
+			up(&dev->sem);
+		}
+		schedule_timeout_interruptible(delay);
+	}
+	return 0;
+}
+
+/* Start, retune or (@rate 0) stop the scrubber */
+static int scull_set_scrub(struct scull_dev *dev, int rate)
+{
+	struct task_struct *task = NULL;
+	int retval = 0;
+
+	if (rate < 0)
+		return -EINVAL;
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	dev->scrub_rate = rate;
+	if (rate && !dev->scrub_task) {
+		task = kthread_run(scull_scrub_thread, dev, "scull_scrub");
+		if (IS_ERR(task))
+			retval = PTR_ERR(task);
+		else
+			dev->scrub_task = task;
+		task = NULL;
+	} else if (!rate) {
+		task = dev->scrub_task;
+		dev->scrub_task = NULL;
+	}
+	up(&dev->sem);
+	/* it takes dev->sem itself, so it is stopped outside of it */
+	if (task)
+		kthread_stop(task);
+	return retval;
+}
+
+static int scull_set_crc(struct scull_dev *dev, int on)
+{
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	/* readers of a sealed device use the crc arrays without the lock */
+	if (dev->sealed) {
+		up(&dev->sem);
+		return -EPERM;
+	}
+	dev->crc_on = on;
+	scull_crc_list(dev->data, dev->quantum, dev->qset, on);
+	if (dev->migrating)
+		scull_crc_list(dev->mig_data, dev->mig_quantum,
+			       dev->mig_qset, on);
+	up(&dev->sem);
+	return scull_set_scrub(dev, on ? scull_scrub_rate : 0);
+}
+
+static int scull_set_mode(struct scull_dev *dev, struct scull_mode *mode)
+{
+	int retval = 0;
+
+	switch (mode->mode) {
+		case SCULL_MODE_PLAIN:
+		case SCULL_MODE_LOG:
+		case SCULL_MODE_KV:
+			break;
+		case SCULL_MODE_RING:
+			if (!mode->capacity || mode->capacity > ULONG_MAX / 2)
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->sealed) {
+		retval = -EPERM;
+		goto out;
+	}
+	/* staged bytes were taken as plain writes */
+	if (atomic_read(&dev->staging)) {
+		retval = -EBUSY;
+		goto out;
+	}
+	scull_migrate_reap(dev);
+	if (dev->migrating) {
+		retval = -EBUSY;
+		goto out;
+	}
+	if (dev->tier_budget && mode->mode != SCULL_MODE_PLAIN) {
+		retval = -EBUSY;
+		goto out;
+	}
+	dev->mode = mode->mode;
+	dev->capacity = mode->capacity;
+	scull_trim(dev);
+out:
+	up(&dev->sem);
+	return retval;
+}
+
+/*
+ * Pick the allocator of a device's quanta. The quanta already there
+ * came from the old one, so like a mode change this empties the device.
+ * The pages backend also sets the quantum, to PAGE_SIZE << order.
+ */
+static int scull_set_backend(struct scull_dev *dev, struct scull_backend *be)
+{
+	int retval = 0;
+
+	switch (be->type) {
+		case SCULL_BACKEND_KMALLOC:
+		case SCULL_BACKEND_VMALLOC:
+			break;
+		case SCULL_BACKEND_PAGES:
+			if (be->order < 0 || be->order >= MAX_ORDER)
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->sealed) {
+		retval = -EPERM;
+		goto out;
+	}
+	scull_migrate_reap(dev);
+	if (dev->migrating) {
+		retval = -EBUSY;
+		goto out;
+	}
+	scull_trim(dev);
+	dev->backend = be->type;
+	if (be->type == SCULL_BACKEND_PAGES) {
+		dev->quantum = PAGE_SIZE << be->order;
+		dev->pinned = 1;
+		if (dev->mode == SCULL_MODE_RING)
+			dev->ring_quanta = DIV_ROUND_UP(dev->capacity,
+							dev->quantum);
+	}
+out:
+	up(&dev->sem);
+	return retval;
+}
+
+/*
+ * Set the RAM budget of a plain device, spilling down to it at once.
+ * A budget of 0 reads everything back in and drops the tier file.
+ */
+static int scull_set_tier(struct scull_dev *dev, unsigned long budget)
+{
+	unsigned long old = dev->tier_budget;
+	struct scull_qset *dptr;
+	int i, retval = 0;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->sealed) {
+		retval = -EPERM;
+		goto out;
+	}
+	scull_migrate_reap(dev);
+	if (dev->migrating) {
+		retval = -EBUSY;
+		goto out;
+	}
+	if (dev->mode != SCULL_MODE_PLAIN ||
+	    (budget && budget < dev->quantum)) {
+		retval = -EINVAL;
+		goto out;
+	}
+	if (budget) {
+		if (!dev->tier_file && (retval = scull_tier_open(dev)))
+			goto out;
+		dev->tier_budget = budget;
+		while (dev->alloc_bytes > budget)
+			if (scull_tier_evict_one(dev))
+				break;
+		goto out;
+	}
+
+	dev->tier_budget = 0;
+	for (dptr = dev->data; dptr; dptr = dptr->next)
+		for (i = 0; dptr->spill && i < dev->qset; i++)
+			if (dptr->spill[i] && !scull_tier_fault(dev, dptr, i)) {
+				dev->tier_budget = old;
+				retval = -ENOMEM;
+				goto out;
+			}
+	scull_tier_close(dev);
+out:
+	up(&dev->sem);
+	return retval;
+}
+
+/*
+ * Seal a device: wait for any re-layout, copy the data into a single
+ * vmalloc'ed buffer when there is room for one, then publish the seal.
+ * From then on nothing can change the layout, so readers skip dev->sem.
+ */
+static int scull_seal(struct scull_dev *dev)
+{
+	unsigned long off, len;
+	size_t room;
+	char *flat, *ptr;
+	int retval = 0;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	while (dev->migrating) {
+		up(&dev->sem);
+		msleep(10);
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+	}
+	scull_migrate_reap(dev);
+	if (dev->sealed)
+		goto out;
+	/* staged bytes would be refused once sealed, after write() took them */
+	if (atomic_read(&dev->staging)) {
+		retval = -EBUSY;
+		goto out;
+	}
+	/* every kv lookup moves entries on the lru list */
+	if (dev->mode == SCULL_MODE_KV) {
+		retval = -EINVAL;
+		goto out;
+	}
+	/* and every tiered lookup may fault a quantum in */
+	if (dev->tier_budget) {
+		retval = -EBUSY;
+		goto out;
+	}
+
+	len = dev->size - dev->start;
+	flat = len ? vmalloc(len) : NULL;
+	if (flat) {
+		for (off = dev->start; off < dev->size; off += room) {
+			ptr = scull_locate(dev, off, &room, 0);
+			room = min_t(unsigned long, room, dev->size - off);
+			if (ptr)
+				memcpy(flat + (off - dev->start), ptr, room);
+			else
+				memset(flat + (off - dev->start), 0, room);
+		}
+		scull_free_list(dev, dev->data, dev->quantum, dev->qc);
+		dev->data = NULL;
+		/* the dirty bits went with the nodes */
+		dev->ckpt_need_base = 1;
+		dev->flat_base = dev->start;
+		dev->flat = flat;
+	}
+	smp_wmb();
+	dev->sealed = 1;
+	/* it won't grow any more, followers get their EOF */
+	wake_up_interruptible(&dev->inq);
+out:
+	up(&dev->sem);
+	return retval;
+}
+
+/*
+ * Followers are not woken for each write: the first growth arms a
+ * timer and whatever lands before it fires goes out in one wakeup, so
+ * a big write in quantum-sized pieces doesn't turn into a stream of
+ * small reads.
+ */
+static void scull_follow_wake(unsigned long data)
+{
+	struct scull_dev *dev = (struct scull_dev *)data;
+
+	wake_up_interruptible(&dev->inq);
+}
+
+static void scull_grew(struct scull_dev *dev)
+{
+	if (!atomic_read(&dev->followers))
+		return;
+	if (!timer_pending(&dev->follow_timer))
+		mod_timer(&dev->follow_timer,
+			  jiffies + msecs_to_jiffies(scull_follow_ms));
+}
+
+/*
+ * Store @count bytes from a kernel buffer at @pos of a plain device,
+ * crossing quanta as needed. Called with dev->sem held.
+ */
+static ssize_t scull_store_kwrite(struct scull_dev *dev, const char *src,
+				  size_t count, unsigned long pos)
+{
+	struct scull_slot slot;
+	size_t room, done, n;
+	char *ptr;
+
+	if (dev->sealed)
+		return -EPERM;
+	if (dev->mode != SCULL_MODE_PLAIN)
+		return -EINVAL;
+	for (done = 0; done < count; done += n) {
+		ptr = scull_locate_slot(dev, pos + done, &room, 1, &slot);
+		if (!ptr)
+			break;
+		n = min(count - done, room);
+		memcpy(ptr, src + done, n);
+		scull_touched(dev, &slot);
+	}
+	if (done && dev->size < pos + done) {
+		dev->size = pos + done;
+		scull_grew(dev);
+	}
+	return done ? done : -ENOMEM;
+}
+
+typedef int (*scull_extent_fn)(struct scull_dev *dev, unsigned long off,
+			       unsigned long len, void *arg);
+
+struct scull_extent_walk {
+	unsigned long off;
+	unsigned long len;
+	scull_extent_fn fn;
+	void *arg;
+};
+
+static int scull_extent_merge(struct scull_dev *dev, unsigned long off,
+			      char *ptr, size_t len, void *arg)
+{
+	struct scull_extent_walk *w = arg;
+	int retval;
+
+	if (off >= dev->size)
+		return 0;
+	if (len > dev->size - off)
+		len = dev->size - off;
+	if (w->len && w->off + w->len == off) {
+		w->len += len;
+		return 0;
+	}
+	if (w->len) {
+		retval = w->fn(dev, w->off, w->len, w->arg);
+		if (retval)
+			return retval;
+	}
+	w->off = off;
+	w->len = len;
+	return 0;
+}
+
+/*
+ * Call @fn on every run of populated bytes below dev->size, adjacent
+ * quanta merged, in one pass over the index. Called with dev->sem held.
+ */
+static int scull_for_each_extent(struct scull_dev *dev, scull_extent_fn fn,
+				 void *arg)
+{
+	struct scull_extent_walk w;
+	int retval;
+
+	w.off = 0;
+	w.len = 0;
+	w.fn = fn;
+	w.arg = arg;
+	retval = scull_walk(dev, scull_extent_merge, &w);
+	if (!retval && w.len)
+		retval = fn(dev, w.off, w.len, arg);
+	return retval;
+}
+
+struct scull_map {
+	struct scull_fiemap req;
+	struct scull_fiemap_extent prev;	/* held back to flag the last one */
+	int have;
+};
+
+static int scull_map_emit(struct scull_map *map)
+{
+	if (map->req.count &&
+	    copy_to_user(&map->req.extents[map->req.mapped], &map->prev,
+			 sizeof(map->prev)))
+		return -EFAULT;
+	map->req.mapped++;
+	return 0;
+}
+
+/* A positive return stops the walk: past the range, or no more room */
+static int scull_map_extent(struct scull_dev *dev, unsigned long off,
+			    unsigned long len, void *arg)
+{
+	struct scull_map *map = arg;
+	u64 end = (u64)off + len;
+	u64 req_end = map->req.start + map->req.length;
+	int retval;
+
+	if (end <= map->req.start)
+		return 0;
+	if (off >= req_end)
+		return 1;
+	if (map->have) {
+		if (map->req.count && map->req.mapped == map->req.count)
+			return 1;
+		retval = scull_map_emit(map);
+		if (retval)
+			return retval;
+	}
+	map->prev.off = max_t(u64, off, map->req.start);
+	map->prev.len = min(end, req_end) - map->prev.off;
+	map->prev.flags = 0;
+	map->prev.pad = 0;
+	map->have = 1;
+	return 0;
+}
+
+/*
+ * Fill in @ureq with the populated ranges of @dev, in one pass over the
+ * index. Holes are whatever is not listed.
+ */
+static int scull_fiemap(struct scull_dev *dev, struct scull_fiemap __user *ureq)
+{
+	struct scull_map map;
+	int retval;
+
+	if (copy_from_user(&map.req, ureq, sizeof(map.req)))
+		return -EFAULT;
+	if (map.req.count && !access_ok(VERIFY_WRITE, map.req.extents,
+			map.req.count * sizeof(struct scull_fiemap_extent)))
+		return -EFAULT;
+	if (map.req.length > ~0ULL - map.req.start)
+		map.req.length = ~0ULL - map.req.start;
+	map.req.mapped = 0;
+	map.have = 0;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	retval = -EINVAL;
+	if (dev->mode == SCULL_MODE_KV)
+		goto out;
+	retval = scull_for_each_extent(dev, scull_map_extent, &map);
+	if (retval < 0)
+		goto out;
+	if (map.have && (!map.req.count || map.req.mapped < map.req.count)) {
+		/* the walk ran to the end, nothing comes after this one */
+		if (!retval)
+			map.prev.flags = SCULL_EXTENT_LAST;
+		retval = scull_map_emit(&map);
+		if (retval)
+			goto out;
+	}
+	retval = put_user(map.req.mapped, &ureq->mapped);
+out:
+	up(&dev->sem);
+	return retval;
+}
+
+/* Buffered sequential access to a backing file, SCULL_IO_CHUNK at a time */
+struct scull_io {
+	struct file *file;
+	loff_t pos;
+	char *buf;
+	size_t len;			/* bytes in buf */
+	size_t head;			/* bytes of buf already consumed */
+};
+
+
+static int scull_io_open(struct scull_io *io, struct scull_dev *dev,
+			 int flags)
+{
+	char *path;
+
+	if (!scull_backing || !*scull_backing)
+		return -ENOENT;
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	snprintf(path, PATH_MAX, "%s%d", scull_backing, dev->index);
+	io->file = filp_open(path, flags | O_LARGEFILE, 0600);
+	kfree(path);
+	if (IS_ERR(io->file))
+		return PTR_ERR(io->file);
+	io->buf = vmalloc(SCULL_IO_CHUNK);
+	if (!io->buf) {
+		filp_close(io->file, NULL);
+		return -ENOMEM;
+	}
+	io->pos = 0;
+	io->len = 0;
+	io->head = 0;
+	return 0;
+}
+
+static int scull_io_flush(struct scull_io *io)
+{
+	ssize_t n;
+
+	if (!io->len)
+		return 0;
+	n = scull_kernel_rw(io->file, io->buf, io->len, &io->pos, 1);
+	if (n != io->len)
+		return n < 0 ? n : -EIO;
+	io->len = 0;
+	return 0;
+}
+
+static void scull_io_close(struct scull_io *io)
+{
+	vfree(io->buf);
+	filp_close(io->file, NULL);
+}
+
+static int scull_io_put(struct scull_io *io, const void *src, size_t len)
+{
+	size_t n;
+	int retval;
+
+	while (len) {
+		if (io->len == SCULL_IO_CHUNK) {
+			retval = scull_io_flush(io);
+			if (retval)
+				return retval;
+		}
+		n = min(len, SCULL_IO_CHUNK - io->len);
+		memcpy(io->buf + io->len, src, n);
+		io->len += n;
+		src += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns -ENODATA at a clean end of file and -EIO at a torn one */
+static int scull_io_get(struct scull_io *io, void *dst, size_t len)
+{
+	size_t n, want = len;
+	ssize_t got;
+
+	while (len) {
+		if (io->head == io->len) {
+			got = scull_kernel_rw(io->file, io->buf, SCULL_IO_CHUNK,
+					      &io->pos, 0);
+			if (got < 0)
+				return got;
+			if (!got)
+				return len == want ? -ENODATA : -EIO;
+			io->len = got;
+			io->head = 0;
+		}
+		n = min(len, io->len - io->head);
+		memcpy(dst, io->buf + io->head, n);
+		io->head += n;
+		dst += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copy @len bytes at @pos of a spilled quantum from the tier file to @io */
+static int scull_tier_put(struct scull_dev *dev, struct scull_io *io,
+			  unsigned long pos, size_t len)
+{
+	unsigned long itemsize = (unsigned long)dev->quantum * dev->qset;
+	int s_pos = (pos % itemsize) / dev->quantum;
+	struct scull_qset *dptr;
+	loff_t tpos;
+	size_t n;
+	int retval;
+
+	dptr = scull_follow(&dev->data, pos / itemsize, dev->qc, 0);
+	tpos = (loff_t)(dptr->spill[s_pos] - 1) * dev->quantum +
+		pos % dev->quantum;
+	while (len) {
+		if (io->len == SCULL_IO_CHUNK) {
+			retval = scull_io_flush(io);
+			if (retval)
+				return retval;
+		}
+		n = min(len, SCULL_IO_CHUNK - io->len);
+		if (scull_kernel_rw(dev->tier_file, io->buf + io->len, n,
+				    &tpos, 0) != n)
+			return -EIO;
+		io->len += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct scull_save {
+	struct scull_io io;
+	struct scull_extent_walk w;	/* used by the dirty walk only */
+};
+
+static int scull_save_extent(struct scull_dev *dev, unsigned long off,
+			     unsigned long len, void *arg)
+{
+	struct scull_save *sv = arg;
+	struct scull_img_extent ext;
+	unsigned long done;
+	size_t room;
+	char *ptr;
+	int retval;
+
+	ext.off = off;
+	ext.len = len;
+	retval = scull_io_put(&sv->io, &ext, sizeof(ext));
+	for (done = 0; !retval && done < len; done += room) {
+		/* a save must not pull the whole tier file back into RAM */
+		if (scull_in_tier(dev, off + done)) {
+			room = dev->quantum - (off + done) % dev->quantum;
+			room = min_t(unsigned long, room, len - done);
+			retval = scull_tier_put(dev, &sv->io, off + done, room);
+			continue;
+		}
+		ptr = scull_locate(dev, off + done, &room, 0);
+		if (!ptr)
+			return -EIO;	/* a fault that failed */
+		room = min_t(unsigned long, room, len - done);
+		retval = scull_io_put(&sv->io, ptr, room);
+	}
+	return retval;
+}
+
+/* Forget what has been written since the last checkpoint */
+static void scull_dirty_clear(struct scull_dev *dev)
+{
+	struct scull_qset *dptr;
+
+	for (dptr = dev->data; dptr; dptr = dptr->next) {
+		if (dptr->dirty)
+			memset(dptr->dirty, 0,
+			       BITS_TO_LONGS(dev->qset) * sizeof(long));
+		dptr->ndirty = 0;
+	}
+}
+
+/*
+ * Feed the dirty quanta to scull_save_extent(), clearing them on the
+ * way. Clean nodes are skipped on their count alone, so the cost goes
+ * with the number of quanta written since the last checkpoint.
+ */
+static int scull_save_dirty(struct scull_dev *dev, struct scull_save *sv)
+{
+	unsigned long itemsize = (unsigned long)dev->quantum * dev->qset;
+	struct scull_qset *dptr;
+	unsigned long off;
+	int i, retval = 0;
+
+	sv->w.off = 0;
+	sv->w.len = 0;
+	sv->w.fn = scull_save_extent;
+	sv->w.arg = sv;
+	for (dptr = dev->data, off = 0; dptr; dptr = dptr->next, off += itemsize) {
+		if (!dptr->ndirty)
+			continue;
+		for (i = find_first_bit(dptr->dirty, dev->qset); i < dev->qset;
+		     i = find_next_bit(dptr->dirty, dev->qset, i + 1)) {
+			/* spilled ones are copied from the tier file */
+			if (!retval && (dptr->data[i] ||
+					(dptr->spill && dptr->spill[i])))
+				retval = scull_extent_merge(dev,
+						off + (unsigned long)i * dev->quantum,
+						dptr->data[i], dev->quantum, &sv->w);
+			clear_bit(i, dptr->dirty);
+		}
+		dptr->ndirty = 0;
+	}
+	if (!retval && sv->w.len)
+		retval = scull_save_extent(dev, sv->w.off, sv->w.len, sv);
+	return retval;
+}
+
+/*
+ * Write one image segment. A base segment truncates the file and holds
+ * everything; a delta is appended and holds the quanta written since
+ * the previous segment. Called with dev->sem held.
+ */
+static int scull_save_segment(struct scull_dev *dev, int type)
+{
+	struct scull_save sv;
+	struct scull_img_hdr hdr;
+	struct scull_img_extent end;
+	loff_t start;
+	int retval;
+
+	if (dev->mode != SCULL_MODE_PLAIN)
+		return -EINVAL;
+	if (type == SCULL_IMG_DELTA && dev->migrating)
+		return -EBUSY;
+	retval = scull_io_open(&sv.io, dev, type == SCULL_IMG_BASE ?
+			       O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY);
+	if (retval)
+		return retval;
+	if (type == SCULL_IMG_DELTA)
+		sv.io.pos = i_size_read(sv.io.file->f_dentry->d_inode);
+	start = sv.io.pos;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SCULL_IMG_MAGIC;
+	hdr.version = SCULL_IMG_VERSION;
+	hdr.quantum = dev->migrating ? dev->mig_quantum : dev->quantum;
+	hdr.qset = dev->migrating ? dev->mig_qset : dev->qset;
+	hdr.type = type;
+	hdr.gen = type == SCULL_IMG_BASE ? 0 : dev->ckpt_gen + 1;
+	hdr.size = dev->size;
+	retval = scull_io_put(&sv.io, &hdr, sizeof(hdr));
+	if (retval)
+		goto out;
+	if (type == SCULL_IMG_BASE) {
+		scull_dirty_clear(dev);
+		retval = scull_for_each_extent(dev, scull_save_extent, &sv);
+	} else {
+		retval = scull_save_dirty(dev, &sv);
+	}
+	if (retval)
+		goto out;
+	end.off = SCULL_IMG_END;
+	end.len = 0;
+	retval = scull_io_put(&sv.io, &end, sizeof(end));
+	if (!retval)
+		retval = scull_io_flush(&sv.io);
+out:
+	scull_io_close(&sv.io);
+	if (retval) {
+		/* dirty bits may be gone, only a new base is safe now */
+		dev->ckpt_need_base = 1;
+		return retval;
+	}
+	dev->ckpt_gen = hdr.gen;
+	dev->ckpt_need_base = 0;
+	dev->dirty_track = 1;
+	if (type == SCULL_IMG_BASE) {
+		dev->ckpt_base_bytes = sv.io.pos;
+		dev->ckpt_delta_bytes = 0;
+	} else {
+		dev->ckpt_delta_bytes += sv.io.pos - start;
+	}
+	return 0;
+}
+
+/* Nonzero if anything was written since the last segment */
+static int scull_any_dirty(struct scull_dev *dev)
+{
+	struct scull_qset *dptr;
+
+	for (dptr = dev->data; dptr; dptr = dptr->next)
+		if (dptr->ndirty)
+			return 1;
+	return 0;
+}
+
+/* Write a full image of @dev to its backing file */
+static int scull_save(struct scull_dev *dev)
+{
+	int retval;
+
+	down(&dev->sem);
+	retval = scull_save_segment(dev, SCULL_IMG_BASE);
+	up(&dev->sem);
+	return retval;
+}
+
+/*
+ * Append what changed since the last segment, or start a new base once
+ * the deltas outgrow it, so the file and the replay stay bounded.
+ */
+static int scull_checkpoint(struct scull_dev *dev)
+{
+	int retval = 0;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	scull_migrate_reap(dev);
+	if (dev->ckpt_need_base || !dev->dirty_track ||
+	    dev->ckpt_delta_bytes > dev->ckpt_base_bytes)
+		retval = scull_save_segment(dev, SCULL_IMG_BASE);
+	else if (scull_any_dirty(dev))
+		retval = scull_save_segment(dev, SCULL_IMG_DELTA);
+	up(&dev->sem);
+	return retval;
+}
+
+static int scull_ckpt_thread(void *data)
+{
+	struct scull_dev *dev = data;
+	int err;
+
+	while (!kthread_should_stop()) {
+		schedule_timeout_interruptible(scull_ckpt_interval * HZ);
+		if (kthread_should_stop())
+			break;
+		err = scull_checkpoint(dev);
+		if (err && err != -ERESTARTSYS)
+			printk(KERN_NOTICE "scull%d: checkpoint failed %d\n",
+			       dev->index, err);
+	}
+	return 0;
+}
+
+/*
+ * Replace the contents of @dev with its image: the base segment, then
+ * every delta after it in order. Called with dev->sem held.
+ */
+static int __scull_restore(struct scull_dev *dev)
+{
+	struct scull_io io;
+	struct scull_img_hdr hdr;
+	struct scull_img_extent ext;
+	struct scull_slot slot;
+	unsigned long done;
+	size_t room;
+	char *ptr;
+	int retval, segs;
+
+	if (dev->sealed)
+		return -EPERM;
+	if (dev->mode != SCULL_MODE_PLAIN)
+		return -EINVAL;
+	scull_migrate_reap(dev);
+	if (dev->migrating)
+		return -EBUSY;
+
+	retval = scull_io_open(&io, dev, O_RDONLY);
+	if (retval)
+		return retval;
+
+	for (segs = 0; ; segs++) {
+		retval = scull_io_get(&io, &hdr, sizeof(hdr));
+		if (retval == -ENODATA && segs)
+			break;
+		if (retval)
+			goto bad;
+		retval = -EINVAL;
+		if (hdr.magic != SCULL_IMG_MAGIC ||
+		    hdr.version != SCULL_IMG_VERSION ||
+		    !scull_geometry_valid(dev, hdr.quantum, hdr.qset))
+			goto bad;
+		if (!segs) {
+			if (hdr.type != SCULL_IMG_BASE)
+				goto bad;
+			scull_trim(dev);
+			retval = scull_set_qset(dev, hdr.qset);
+			if (retval)
+				goto bad;
+			dev->quantum = hdr.quantum;
+			dev->pinned = 1;
+		} else if (hdr.type != SCULL_IMG_DELTA ||
+			   hdr.gen != dev->ckpt_gen + 1 ||
+			   hdr.quantum != dev->quantum || hdr.qset != dev->qset) {
+			goto bad;
+		}
+
+		for (;;) {
+			retval = scull_io_get(&io, &ext, sizeof(ext));
+			if (retval)
+				goto bad;
+			if (ext.off == SCULL_IMG_END)
+				break;
+			for (done = 0; done < ext.len; done += room) {
+				retval = -ENOMEM;
+				ptr = scull_locate_slot(dev, ext.off + done,
+							&room, 1, &slot);
+				if (!ptr)
+					goto bad;
+				room = min_t(unsigned long, room, ext.len - done);
+				retval = scull_io_get(&io, ptr, room);
+				if (retval)
+					goto bad;
+				scull_touched(dev, &slot);
+			}
+		}
+		dev->size = hdr.size;
+		dev->ckpt_gen = hdr.gen;
+		/* bytes of the file consumed so far */
+		if (!segs)
+			dev->ckpt_base_bytes = io.pos - (io.len - io.head);
+	}
+
+	/* what is in memory now is exactly what is on file */
+	scull_dirty_clear(dev);
+	dev->dirty_track = 1;
+	dev->ckpt_need_base = 0;
+	dev->ckpt_delta_bytes = io.pos - dev->ckpt_base_bytes;
+	retval = 0;
+	goto out;
+
+bad:
+	if (segs) {
+		/* a torn delta at the end: keep base and the whole deltas */
+		printk(KERN_NOTICE "scull%d: image segment %d unusable, "
+		       "restored up to generation %u\n", dev->index, segs,
+		       dev->ckpt_gen);
+		scull_dirty_clear(dev);
+		dev->dirty_track = 1;
+		dev->ckpt_need_base = 1;
+		retval = 0;
+	} else {
+		/* don't leave half an image behind */
+		scull_trim(dev);
+	}
+out:
+	scull_io_close(&io);
+	return retval;
+}
+
+static int scull_restore(struct scull_dev *dev)
+{
+	int retval;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	dev->restore_pending = 0;
+	retval = __scull_restore(dev);
+	up(&dev->sem);
+	return retval;
+}
+
+/* Push the staged bytes of @sf into the device */
+static int scull_flush_wbuf(struct scull_file *sf, int intr)
+{
+	struct scull_dev *dev = sf->dev;
+	ssize_t retval;
+
+	if (!sf->wlen)
+		return 0;
+	if (!intr)
+		down(&dev->sem);
+	else if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	retval = scull_store_kwrite(dev, sf->wbuf, sf->wlen, sf->wpos);
+	up(&dev->sem);
+	/* write() already took these bytes, keep whatever didn't go in */
+	if (retval < 0)
+		return retval;
+	if (retval < sf->wlen) {
+		memmove(sf->wbuf, sf->wbuf + retval, sf->wlen - retval);
+		sf->wpos += retval;
+		sf->wsize -= retval;
+		sf->wlen -= retval;
+		return -ENOMEM;
+	}
+	sf->wlen = 0;
+	atomic_dec(&dev->staging);
+	return 0;
+}
+
+/*
+ * Stage a small write in the per-file buffer without taking dev->sem.
+ * A run starts wherever the write lands and ends at the next quantum
+ * boundary, so every flush fills the tail of exactly one quantum.
+ * Returns -EAGAIN when the write should take the normal path instead.
+ */
+static ssize_t scull_stage_write(struct scull_file *sf, const char __user *buf,
+				 size_t count, loff_t *f_pos)
+{
+	struct scull_dev *dev = sf->dev;
+	int quantum = dev->quantum;
+	int retval;
+
+	/* the bytes would only be refused at flush time, after we said yes */
+	if (dev->sealed)
+		return -EPERM;
+	if (sf->wlen && (*f_pos != sf->wpos + sf->wlen ||
+			 sf->wlen + count > sf->wsize)) {
+		retval = scull_flush_wbuf(sf, 1);
+		if (retval)
+			return retval;
+	}
+	if (!sf->wlen) {
+		if (count > quantum / 2)
+			return -EAGAIN;
+		if (sf->wcap < quantum) {
+			kfree(sf->wbuf);
+			sf->wcap = 0;
+			sf->wbuf = kmalloc(quantum, GFP_KERNEL);
+			if (!sf->wbuf)
+				return -EAGAIN;
+			sf->wcap = quantum;
+		}
+		sf->wpos = *f_pos;
+		sf->wsize = quantum - *f_pos % quantum;
+		if (count > sf->wsize)
+			return -EAGAIN;
+		if (copy_from_user(sf->wbuf, buf, count))
+			return -EFAULT;
+		/* seal and mode changes check the count under dev->sem */
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		retval = dev->sealed ? -EPERM : 0;
+		if (!retval && dev->mode != SCULL_MODE_PLAIN)
+			retval = -EAGAIN;
+		if (!retval)
+			atomic_inc(&dev->staging);
+		up(&dev->sem);
+		if (retval)
+			return retval;
+	} else if (copy_from_user(sf->wbuf + sf->wlen, buf, count))
+		return -EFAULT;
+	sf->wlen += count;
+	*f_pos += count;
+	if (sf->wlen == sf->wsize) {
+		retval = scull_flush_wbuf(sf, 1);
+		if (retval)
+			return retval;
+	}
+	return count;
+}
+
+/*
+ * An instance is created by the control device with nothing behind it
+ * but a reserved minor; the first open builds the struct scull_dev.
+ * Its first qset waits for the first write, like any other.
+ */
+static struct scull_dev *scull_dev_alloc(int index)
+{
+	struct scull_dev *dev;
+
+	dev = kmalloc(sizeof(struct scull_dev), GFP_KERNEL);
+	if (!dev)
+		return NULL;
+	memset(dev, 0, sizeof(struct scull_dev));
+	dev->quantum = scull_quantum;
+	if (scull_set_qset(dev, scull_qset)) {
+		kfree(dev);
+		return NULL;
+	}
+	dev->index = index;
+	dev->backend = scull_backend;
+	if (dev->backend == SCULL_BACKEND_PAGES) {
+		dev->quantum = PAGE_SIZE << scull_order;
+		dev->pinned = 1;
+	}
+	sema_init(&dev->sem, 1);
+	init_waitqueue_head(&dev->inq);
+	atomic_set(&dev->followers, 0);
+	atomic_set(&dev->staging, 0);
+	init_timer(&dev->follow_timer);
+	dev->follow_timer.function = scull_follow_wake;
+	dev->follow_timer.data = (unsigned long)dev;
+	spin_lock_init(&dev->pool_lock);
+	INIT_WORK(&dev->pool_work, scull_pool_refill, dev);
+	if (scull_pool_size > 0) {
+		/* no pool is no error, allocations just go to the slab */
+		dev->pool = kmalloc(scull_pool_size * sizeof(void *),
+				    GFP_KERNEL);
+		dev->pool_quantum = dev->quantum;
+		dev->pool_backend = dev->backend;
+	}
+
+	if (scull_backing && *scull_backing) {
+		dev->restore_pending = 1;
+		if (scull_ckpt_interval > 0) {
+			dev->ckpt_task = kthread_run(scull_ckpt_thread, dev,
+						     "scull_ckpt");
+			if (IS_ERR(dev->ckpt_task))
+				dev->ckpt_task = NULL;
+		}
+	}
+	return dev;
+}
+
+static void scull_dev_del(struct scull_dev *dev)
+{
+	if (dev->ckpt_task)
+		kthread_stop(dev->ckpt_task);
+	del_timer_sync(&dev->follow_timer);
+	/* not scull_set_scrub(): a signal must not leave the thread running */
+	if (dev->scrub_task)
+		kthread_stop(dev->scrub_task);
+	dev->scrub_task = NULL;
+	scull_migrate_abort(dev);
+	scull_trim(dev);	
+	scull_tier_close(dev);
+	if (dev->pool) {
+		/* nothing queues it any more, let a running refill finish */
+		flush_workqueue(scull_pool_wq);
+		scull_pool_drain(dev, dev->backend, 0);
+		kfree(dev->pool);
+	}
+	//dev->access_key = 0;
+	kfree(dev);
+}
+
+/* Called with scull_devs_sem held */
+static struct scull_dev *scull_dev_get(int index)
+{
+	struct scull_dev *dev = idr_find(&scull_idr, index);
+
+	if (dev == SCULL_DEV_RESERVED) {
+		dev = scull_dev_alloc(index);
+		if (!dev)
+			return ERR_PTR(-ENOMEM);
+		idr_replace(&scull_idr, dev, index);
+	}
+	return dev ? dev : ERR_PTR(-ENODEV);
+}
+
+/*
+ * Pin instance @index against removal, building it and running its
+ * lazy restore if this is the first user. Process context only.
+ */
+struct scull_dev *scull_get(int index)
+{
+	struct scull_dev *dev;
+
+	if (down_interruptible(&scull_devs_sem))
+		return ERR_PTR(-ERESTARTSYS);
+	dev = scull_dev_get(index);
+	if (!IS_ERR(dev))
+		dev->users++;
+	up(&scull_devs_sem);
+	if (IS_ERR(dev) || !dev->restore_pending)
+		return dev;
+
+	if (down_interruptible(&dev->sem)) {
+		scull_put(dev);
+		return ERR_PTR(-ERESTARTSYS);
+	}
+	if (dev->restore_pending) {
+		dev->restore_pending = 0;
+		if (__scull_restore(dev))
+			printk(KERN_NOTICE "scull%d: lazy restore failed\n",
+			       dev->index);
+	}
+	up(&dev->sem);
+	return dev;
+}
+EXPORT_SYMBOL(scull_get);
+
+void scull_put(struct scull_dev *dev)
+{
+	down(&scull_devs_sem);
+	dev->users--;
+	up(&scull_devs_sem);
+}
+EXPORT_SYMBOL(scull_put);
+
+int scull_open (struct inode *inode, struct file *filp)
+{
+	struct scull_dev *dev;
+	struct scull_file *sf;
+
+	sf = kmalloc(sizeof(struct scull_file), GFP_KERNEL);
+	if (!sf)
+		return -ENOMEM;
+	memset(sf, 0, sizeof(struct scull_file));
+
+	dev = scull_get(iminor(inode) - scull_minor);
+	if (IS_ERR(dev)) {
+		kfree(sf);
+		return PTR_ERR(dev);
+	}
+	sf->dev = dev;
+	filp->private_data = sf;
+
+	/*
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		scull_trim(dev);
+	}
+	 */
+	return 0;
+}
+
+int scull_release (struct inode *inode, struct file *filp)
+{
+	struct scull_file *sf = filp->private_data;
+
+	if (scull_flush_wbuf(sf, 0)) {
+		printk(KERN_NOTICE "scull%d: %lu staged bytes lost on close\n",
+		       sf->dev->index, (unsigned long)sf->wlen);
+		atomic_dec(&sf->dev->staging);
+	}
+	if (sf->follow)
+		atomic_dec(&sf->dev->followers);
+	scull_put(sf->dev);
+	kfree(sf->wbuf);
+	kfree(sf);
+	filp->private_data = NULL;
+	return 0;
+}
+
+static int scull_fsync(struct file *filp, struct dentry *dentry, int datasync)
+{
+	return scull_flush_wbuf(filp->private_data, 1);
+}
+
+/*
+ * In-kernel clients. They hold an instance with scull_get() and move
+ * data through kernel buffers or pages; nothing goes through a user
+ * copy and the per-file staging of write() is not involved. All of
+ * this may sleep.
+ */
+
+/* Read up to @count bytes at @pos, stopping at a hole. dev->sem held */
+static ssize_t scull_store_kread(struct scull_dev *dev, char *dst,
+				 size_t count, unsigned long pos)
+{
+	struct scull_slot slot;
+	size_t room, done, n;
+	char *ptr;
+
+	if (pos >= dev->size)
+		return 0;
+	count = min_t(unsigned long, count, dev->size - pos);
+	for (done = 0; done < count; done += n) {
+		ptr = scull_locate_slot(dev, pos + done, &room, 0, &slot);
+		if (!ptr)
+			break;
+		if (scull_crc_bad(dev, &slot)) {
+			dev->scrub.read_errors++;
+			return done ? done : -EIO;
+		}
+		n = min(count - done, room);
+		memcpy(dst + done, ptr, n);
+	}
+	return done;
+}
+
+/* Lock @dev for a transfer; a sealed device is read without the lock */
+static int scull_kio_lock(struct scull_dev *dev, int write)
+{
+	if (dev->mode == SCULL_MODE_KV)
+		return -EINVAL;
+	if (!write && dev->sealed) {
+		smp_rmb();
+		return 0;
+	}
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	return 1;
+}
+
+static ssize_t scull_kio(struct scull_dev *dev, char *buf, size_t len,
+			 loff_t *pos, int write)
+{
+	ssize_t n;
+
+	if (!len)
+		return 0;
+	if (write) {
+		n = scull_store_kwrite(dev, buf, len, *pos);
+	} else {
+		/* what was below the window has been overwritten, skip it */
+		if (*pos < dev->start)
+			*pos = dev->start;
+		n = scull_store_kread(dev, buf, len, *pos);
+	}
+	if (n > 0)
+		*pos += n;
+	return n;
+}
+
+static ssize_t scull_kvec_rw(struct scull_dev *dev, const struct kvec *vec,
+			     unsigned long nr, loff_t *pos, int write)
+{
+	ssize_t n, done = 0;
+	unsigned long i;
+	int locked;
+
+	locked = scull_kio_lock(dev, write);
+	if (locked < 0)
+		return locked;
+	for (i = 0; i < nr; i++) {
+		n = scull_kio(dev, vec[i].iov_base, vec[i].iov_len, pos, write);
+		if (n < 0 && !done)
+			done = n;
+		if (n < 0)
+			break;
+		done += n;
+		if (n < vec[i].iov_len)
+			break;
+	}
+	if (locked)
+		up(&dev->sem);
+	return done;
+}
+
+static ssize_t scull_bvec_rw(struct scull_dev *dev, const struct bio_vec *bv,
+			     unsigned long nr, loff_t *pos, int write)
+{
+	ssize_t n, done = 0;
+	unsigned long i;
+	int locked;
+
+	locked = scull_kio_lock(dev, write);
+	if (locked < 0)
+		return locked;
+	for (i = 0; i < nr; i++) {
+		n = scull_kio(dev, (char *)kmap(bv[i].bv_page) + bv[i].bv_offset,
+			      bv[i].bv_len, pos, write);
+		kunmap(bv[i].bv_page);
+		if (n < 0 && !done)
+			done = n;
+		if (n < 0)
+			break;
+		done += n;
+		if (n < bv[i].bv_len)
+			break;
+	}
+	if (locked)
+		up(&dev->sem);
+	return done;
+}
+
+ssize_t scull_kread(struct scull_dev *dev, const struct kvec *vec,
+		    unsigned long nr, loff_t *pos)
+{
+	return scull_kvec_rw(dev, vec, nr, pos, 0);
+}
+EXPORT_SYMBOL(scull_kread);
+
+ssize_t scull_kwrite(struct scull_dev *dev, const struct kvec *vec,
+		     unsigned long nr, loff_t *pos)
+{
+	return scull_kvec_rw(dev, vec, nr, pos, 1);
+}
+EXPORT_SYMBOL(scull_kwrite);
+
+ssize_t scull_kread_pages(struct scull_dev *dev, const struct bio_vec *bv,
+			  unsigned long nr, loff_t *pos)
+{
+	return scull_bvec_rw(dev, bv, nr, pos, 0);
+}
+EXPORT_SYMBOL(scull_kread_pages);
+
+ssize_t scull_kwrite_pages(struct scull_dev *dev, const struct bio_vec *bv,
+			   unsigned long nr, loff_t *pos)
+{
+	return scull_bvec_rw(dev, bv, nr, pos, 1);
+}
+EXPORT_SYMBOL(scull_kwrite_pages);
+
+/*
+ * Hand out the quantum holding @pos itself, from @pos to its end (or
+ * to size, for reading). The device stays locked until scull_return(),
+ * so the lease must be short and must not call back into scull.
+ */
+int scull_borrow(struct scull_dev *dev, loff_t pos, int write,
+		 struct scull_lease *lease)
+{
+	struct scull_slot slot;
+	size_t room;
+	char *ptr;
+	int locked, retval;
+
+	locked = scull_kio_lock(dev, write);
+	if (locked < 0)
+		return locked;
+	if (write) {
+		retval = -EPERM;
+		if (dev->sealed)
+			goto fail;
+		retval = -EINVAL;
+		if (dev->mode != SCULL_MODE_PLAIN)
+			goto fail;
+		retval = -ENOMEM;
+		ptr = scull_locate_slot(dev, pos, &room, 1, &slot);
+		if (!ptr)
+			goto fail;
+	} else {
+		retval = -ENODATA;
+		if (pos < dev->start || pos >= dev->size)
+			goto fail;
+		ptr = scull_locate_slot(dev, pos, &room, 0, &slot);
+		if (!ptr)
+			goto fail;
+		retval = -EIO;
+		if (scull_crc_bad(dev, &slot))
+			goto fail;
+		room = min_t(unsigned long, room, dev->size - pos);
+	}
+	lease->dev = dev;
+	lease->pos = pos;
+	lease->ptr = ptr;
+	lease->len = room;
+	lease->write = write;
+	lease->locked = locked;
+	return 0;
+
+fail:
+	if (locked)
+		up(&dev->sem);
+	return retval;
+}
+EXPORT_SYMBOL(scull_borrow);
+
+/* End a lease; @written bytes from the start of a write lease are kept */
+void scull_return(struct scull_lease *lease, size_t written)
+{
+	struct scull_dev *dev = lease->dev;
+	struct scull_slot slot;
+	size_t room;
+
+	if (lease->write && written) {
+		written = min(written, lease->len);
+		if (scull_locate_slot(dev, lease->pos, &room, 0, &slot))
+			scull_touched(dev, &slot);
+		if (dev->size < lease->pos + written) {
+			dev->size = lease->pos + written;
+			scull_grew(dev);
+		}
+	}
+	if (lease->locked)
+		up(&dev->sem);
+	lease->ptr = NULL;
+}
+EXPORT_SYMBOL(scull_return);
+
+/* Called with dev->sem held, or without it once the device is sealed */
+static ssize_t __scull_read(struct scull_dev *dev, char __user *buf,
+			    size_t count, loff_t *f_pos)
+{
+	struct scull_slot slot;
+	char *ptr;
+	size_t room;
+
+	if (dev->mode == SCULL_MODE_KV)
+		return -EINVAL;
+	/* what was below the window has been overwritten, skip it */
+	if (*f_pos < dev->start)
+		*f_pos = dev->start;
+	if (*f_pos >= dev->size) 
+		return 0;
+	
+	if (*f_pos + count > dev->size)
+		count = dev->size - *f_pos;
+
+	ptr = scull_locate_slot(dev, *f_pos, &room, 0, &slot);
+	if (ptr == NULL)
+		return 0;
+	if (scull_crc_bad(dev, &slot)) {
+		dev->scrub.read_errors++;
+		if (printk_ratelimit())
+			printk(KERN_WARNING "scull: crc mismatch at %lu\n",
+			       (unsigned long)*f_pos);
+		return -EIO;
+	}
+
+	if (count > room)
+		count = room;
+
+	if (copy_to_user(buf, ptr, count))
+		return -EFAULT;
+
+	*f_pos += count;
+	return count;
+}
+
+ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	ssize_t retval;
+
+	/* a reader must see what it wrote through the same file */
+	retval = scull_flush_wbuf(sf, 1);
+	if (retval)
+		return retval;
+	if (dev->sealed) {
+		smp_rmb();
+		return __scull_read(dev, buf, count, f_pos);
+	}
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	while (sf->follow && *f_pos >= dev->size && !dev->sealed &&
+	       dev->mode != SCULL_MODE_KV) {
+		up(&dev->sem);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->inq,
+				*f_pos < dev->size || dev->sealed))
+			return -ERESTARTSYS;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+	}
+	retval = __scull_read(dev, buf, count, f_pos);
+	up(&dev->sem);
+	return retval;
+}
+
+static unsigned int scull_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &dev->inq, wait);
+	down(&dev->sem);
+	/* only a follower can block on read, at the end of the device */
+	if (!sf->follow || filp->f_pos < dev->size || dev->sealed ||
+	    dev->mode == SCULL_MODE_KV)
+		mask |= POLLIN | POLLRDNORM;
+	if (!dev->sealed && dev->mode != SCULL_MODE_KV)
+		mask |= POLLOUT | POLLWRNORM;
+	up(&dev->sem);
+	return mask;
+}
+
+ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_slot slot;
+	char *ptr;
+	size_t room, done;
+	u64 start;
+	ssize_t retval =  -ENOMEM;
+
+	if (sf->coalesce && dev->mode == SCULL_MODE_PLAIN) {
+		retval = scull_stage_write(sf, buf, count, f_pos);
+		if (retval != -EAGAIN)
+			return retval;
+	}
+	retval = scull_flush_wbuf(sf, 1);
+	if (retval)
+		return retval;
+	retval = -ENOMEM;
+	
+	start = scull_now_ns();
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	if (dev->sealed) {
+		retval = -EPERM;
+		goto out;
+	}
+	if (dev->mode == SCULL_MODE_RING) {
+		/* a ring only appends */
+		*f_pos = dev->size;
+		scull_ring_advance(dev, *f_pos);
+	} else if (dev->mode == SCULL_MODE_LOG) {
+		retval = scull_log_write(dev, buf, count, f_pos);
+		goto out;
+	} else if (dev->mode == SCULL_MODE_KV) {
+		retval = -EINVAL;
+		goto out;
+	}
+	ptr = scull_locate_slot(dev, *f_pos, &room, 1, &slot);
+	if (ptr == NULL) 
+		goto out;
+	done = min(count, room);
+	if (copy_from_user(ptr, buf, done)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	scull_touched(dev, &slot);
+	
+	scull_adapt_note(dev, *f_pos, count, done, scull_now_ns() - start);
+	*f_pos += done;
+	retval = done;
+
+	if (dev->size < *f_pos)
+		dev->size = *f_pos;
+	
+out:
+	if (retval > 0)
+		scull_grew(dev);
+	up(&dev->sem);
+	return retval;
+
+
+}
+
+/*
+ * Make sure every quantum under [pos, pos + len) exists, zeroing the
+ * ones that didn't, so the copy that follows can't fail halfway.
+ */
+static int scull_populate(struct scull_dev *dev, unsigned long pos,
+			      unsigned long len)
+{
+	struct scull_slot slot;
+	unsigned long end = pos + len;
+	size_t room;
+
+	for (; pos < end; pos += room) {
+		if (scull_locate_slot(dev, pos, &room, 0, &slot))
+			continue;
+		if (!scull_locate_slot(dev, pos, &room, 1, &slot))
+			return -ENOMEM;
+		memset(slot.dptr->data[slot.s_pos], 0, slot.quantum);
+		/* its checksum and the next delta must see the zeroes */
+		scull_touched(dev, &slot);
 	}
-	
-	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
-	dev->data = NULL;
-	
 	return 0;
-	
 }
 
-struct scull_qset* scull_follow(struct scull_dev *dev, int item)
+/*
+ * Apply a batch of writes atomically: the data is copied in from user
+ * space without the lock, then under one hold of dev->sem every quantum
+ * is allocated first and only then is anything written. Readers take
+ * dev->sem too, so they see the whole batch or none of it.
+ */
+static int scull_txn(struct scull_dev *dev, struct scull_txn __user *utxn)
 {
-	struct scull_qset *dptr = NULL;
+	struct scull_txn txn;
+	struct scull_txn_range *r = NULL;
+	unsigned long total = 0;
+	char *stage = NULL, *p;
+	u32 i;
+	int retval;
 
-	if (!dev)
+	if (copy_from_user(&txn, utxn, sizeof(txn)))
+		return -EFAULT;
+	if (!txn.n || txn.n > SCULL_TXN_MAX)
+		return -EINVAL;
+	r = kmalloc(txn.n * sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	retval = -EFAULT;
+	if (copy_from_user(r, txn.ranges, txn.n * sizeof(*r)))
 		goto out;
-	
-	for (dptr = dev->data; dptr && item > 0; item--) {
-		if (!dptr->next) {
-			dptr->next = \
-				kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			memset(dptr->next, 0, sizeof(struct scull_qset));
-		}
-		dptr = dptr->next;
+	retval = -EINVAL;
+	for (i = 0; i < txn.n; i++) {
+		if (r[i].len > SCULL_TXN_BYTES - total ||
+		    r[i].off > ULONG_MAX - r[i].len)
+			goto out;
+		total += r[i].len;
 	}
-	
+
+	retval = -ENOMEM;
+	stage = vmalloc(total ? total : 1);
+	if (!stage)
+		goto out;
+	retval = -EFAULT;
+	for (i = 0, p = stage; i < txn.n; p += r[i].len, i++)
+		if (copy_from_user(p, r[i].buf, r[i].len))
+			goto out;
+
+	retval = -ERESTARTSYS;
+	if (down_interruptible(&dev->sem))
+		goto out;
+	retval = -EPERM;
+	if (dev->sealed)
+		goto unlock;
+	retval = -EINVAL;
+	if (dev->mode != SCULL_MODE_PLAIN)
+		goto unlock;
+	/* a fault-in could still fail once the copy has started */
+	retval = -EBUSY;
+	if (dev->tier_budget)
+		goto unlock;
+	for (i = 0; i < txn.n; i++) {
+		retval = scull_populate(dev, r[i].off, r[i].len);
+		if (retval)
+			goto unlock;
+	}
+	for (i = 0, p = stage; i < txn.n; p += r[i].len, i++)
+		if (r[i].len)
+			scull_store_kwrite(dev, p, r[i].len, r[i].off);
+	retval = 0;
+unlock:
+	up(&dev->sem);
 out:
-	return dptr;
+	vfree(stage);
+	kfree(r);
+	return retval;
 }
 
-int scull_open (struct inode *inode, struct file *filp)
+/*
+ * Allocate every quantum of a range up front, zeroed, so the writes
+ * that follow never allocate and a shortage shows up now. A big range
+ * is done a chunk at a time, dropping dev->sem in between. What was
+ * allocated before a failure stays.
+ */
+static int scull_prealloc(struct scull_dev *dev,
+			  struct scull_prealloc __user *ureq)
 {
-	struct scull_dev *dev;
+	struct scull_prealloc req;
+	unsigned long pos, end, n;
+	int retval = 0;
 
-	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
-	filp->private_data = dev;
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	if (!req.len || req.off > ULONG_MAX - req.len)
+		return -EINVAL;
+	end = req.off + req.len;
 
-	/*
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		scull_trim(dev);
+	for (pos = req.off; pos < end; pos += n) {
+		n = min_t(unsigned long, end - pos, SCULL_IO_CHUNK);
+		if (signal_pending(current))
+			return -EINTR;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		if (dev->sealed)
+			retval = -EPERM;
+		else if (dev->mode != SCULL_MODE_PLAIN)
+			retval = -EINVAL;
+		else if (dev->tier_budget)
+			retval = -EBUSY;	/* it would only spill zeroes */
+		else
+			retval = scull_populate(dev, pos, n);
+		if (!retval && pos + n == end &&
+		    !(req.flags & SCULL_PREALLOC_KEEP_SIZE) && dev->size < end) {
+			dev->size = end;
+			scull_grew(dev);
+		}
+		up(&dev->sem);
+		if (retval)
+			return retval;
+		cond_resched();
 	}
-	 */
 	return 0;
 }
 
-int scull_release (struct inode *inode, struct file *filp)
+/*
+ * Make the page at @page the quantum holding @pos, in place of whatever
+ * was there. Only for quanta of PAGE_SIZE, with dev->sem held.
+ */
+static int scull_adopt_page(struct scull_dev *dev, unsigned long pos,
+			    void *page)
 {
-	filp->private_data = NULL;
+	unsigned long itemsize = (unsigned long)dev->quantum * dev->qset;
+	int s_pos = (pos % itemsize) / dev->quantum;
+	struct scull_qset *dptr;
+	struct scull_slot slot;
+
+	dptr = scull_follow(&dev->data, pos / itemsize, dev->qc, 1);
+	if (!dptr)
+		return -ENOMEM;
+	if (dptr->spill && dptr->spill[s_pos]) {
+		/* replaced whole, the old copy is not needed back */
+		__clear_bit(dptr->spill[s_pos] - 1, dev->tier_map);
+		dptr->spill[s_pos] = 0;
+		dev->tier.spilled -= dev->quantum;
+	}
+	if (dptr->data[s_pos])
+		scull_quantum_free(dev, dptr->data[s_pos], dev->quantum);
+	else if (dev->tier_budget)
+		scull_tier_room(dev);
+	dptr->data[s_pos] = page;
+	dev->alloc_bytes += dev->quantum;
+	if (dev->crc_on && !dptr->crc)
+		scull_crc_fill(dptr, dev->quantum, dev->qset);
+
+	slot.dptr = dptr;
+	slot.s_pos = s_pos;
+	slot.quantum = dev->quantum;
+	scull_touched(dev, &slot);
+	if (dev->size < pos + PAGE_SIZE) {
+		dev->size = pos + PAGE_SIZE;
+		scull_grew(dev);
+	}
 	return 0;
 }
 
-ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * One pipe buffer into the device. A whole, page-aligned page gifted
+ * with SPLICE_F_GIFT (vmsplice) is stolen and becomes the quantum
+ * itself; anything else is copied like a write.
+ */
+static int scull_splice_actor(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *buf, struct splice_desc *sd)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval =  0;
+	struct scull_file *sf = sd->file->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct page *page = buf->page;
+	char *ptr;
+	int retval;
 
+	retval = buf->ops->pin(pipe, buf);
+	if (retval)
+		return retval;
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
-	if (*f_pos >= dev->size) 
+	retval = -EPERM;
+	if (dev->sealed)
 		goto out;
-	
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
-
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum;
-	q_pos = rest % quantum;
-
-	dptr = scull_follow(dev, item);
-
-	if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
+	retval = -EINVAL;
+	if (dev->mode != SCULL_MODE_PLAIN)
 		goto out;
 
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
+	if ((sd->flags & SPLICE_F_GIFT) && dev->quantum == PAGE_SIZE &&
+	    dev->backend != SCULL_BACKEND_VMALLOC && !dev->migrating &&
+	    buf->offset == 0 && sd->len == PAGE_SIZE &&
+	    !(sd->pos & ~PAGE_MASK) && !PageHighMem(page) &&
+	    !buf->ops->steal(pipe, buf)) {
+		/* ours now: keep it past the pipe's release */
+		get_page(page);
+		unlock_page(page);
+		retval = scull_adopt_page(dev, sd->pos, page_address(page));
+		if (!retval) {
+			dev->gifted++;
+			retval = sd->len;
+			goto out;
+		}
+		retval = scull_store_kwrite(dev, page_address(page), sd->len,
+					    sd->pos);
+		put_page(page);
 		goto out;
 	}
 
-	*f_pos += count;
-	retval = count;
-
+	ptr = buf->ops->map(pipe, buf, 0);
+	retval = scull_store_kwrite(dev, ptr + buf->offset, sd->len, sd->pos);
+	buf->ops->unmap(pipe, buf, ptr);
 out:
 	up(&dev->sem);
 	return retval;
 }
 
-ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t scull_splice_write(struct pipe_inode_info *pipe,
+				  struct file *out, loff_t *ppos, size_t len,
+				  unsigned int flags)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval =  -ENOMEM;
-	
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum;
-	q_pos = rest % quantum;
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL) 
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data) 
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-	if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	
-	*f_pos += count;
-	retval = count;
-
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+	ssize_t retval;
 
-	printk(KERN_INFO "Total Size: %lu\n", dev->size);
-	
-out:
-	up(&dev->sem);
+	retval = scull_flush_wbuf(out->private_data, 1);
+	if (retval)
+		return retval;
+	retval = splice_from_pipe(pipe, out, ppos, len, flags,
+				  scull_splice_actor);
+	if (retval > 0)
+		*ppos += retval;
 	return retval;
-
-
 }
 
 int scull_ioctl (struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
 {
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_geom geom;
+	struct scull_mode mode;
+	struct scull_backend be;
+	struct scull_window window;
+	unsigned long ul;
 	int err = 0;
 	int tmp = 0;
 	int retval = 0;
@@ -338,6 +4245,230 @@ int scull_ioctl (struct inode *inode, struct file *filp, unsigned int cmd, unsig
 			tmp = scull_qset;
 			scull_qset = arg;
 			return tmp;
+
+		case SCULL_IOCSGEOM:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			if (copy_from_user(&geom, (void __user *)arg, sizeof(geom)))
+				return -EFAULT;
+			retval = scull_set_geometry(dev, &geom);
+			break;
+
+		case SCULL_IOCSADAPT:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = __get_user(tmp, (int __user *)arg);
+			if (retval)
+				break;
+			if (down_interruptible(&dev->sem))
+				return -ERESTARTSYS;
+			dev->adapt.enabled = !!tmp;
+			dev->adapt.pending = 0;
+			up(&dev->sem);
+			break;
+
+		case SCULL_IOCGADAPT:
+			retval = scull_adapt_report(dev,
+					(struct scull_adapt_info __user *)arg);
+			break;
+
+		case SCULL_IOCSMODE:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			if (copy_from_user(&mode, (void __user *)arg, sizeof(mode)))
+				return -EFAULT;
+			/* our own staged bytes go in first, others make it -EBUSY */
+			retval = scull_flush_wbuf(sf, 1);
+			if (!retval)
+				retval = scull_set_mode(dev, &mode);
+			break;
+
+		case SCULL_IOCGMODE:
+			memset(&mode, 0, sizeof(mode));
+			mode.mode = dev->mode;
+			mode.capacity = dev->capacity;
+			if (copy_to_user((void __user *)arg, &mode, sizeof(mode)))
+				return -EFAULT;
+			break;
+
+		case SCULL_IOCQRECORDS:
+			return dev->nr_recs;
+
+		case SCULL_IOCSCOALESCE:
+			retval = __get_user(tmp, (int __user *)arg);
+			if (retval)
+				break;
+			if (!tmp)
+				retval = scull_flush_wbuf(sf, 1);
+			sf->coalesce = !!tmp;
+			break;
+
+		case SCULL_IOCSCRC:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = __get_user(tmp, (int __user *)arg);
+			if (retval == 0)
+				retval = scull_set_crc(dev, !!tmp);
+			break;
+
+		case SCULL_IOCSSCRUB:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = __get_user(tmp, (int __user *)arg);
+			if (retval == 0)
+				retval = scull_set_scrub(dev, tmp);
+			break;
+
+		case SCULL_IOCGSCRUB:
+			if (down_interruptible(&dev->sem))
+				return -ERESTARTSYS;
+			dev->scrub.crc = dev->crc_on;
+			dev->scrub.rate = dev->scrub_task ? dev->scrub_rate : 0;
+			retval = copy_to_user((void __user *)arg, &dev->scrub,
+					      sizeof(dev->scrub)) ? -EFAULT : 0;
+			up(&dev->sem);
+			break;
+
+		case SCULL_IOCSAVE:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = scull_save(dev);
+			break;
+
+		case SCULL_IOCRESTORE:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = scull_restore(dev);
+			break;
+
+		case SCULL_IOCCHECKPOINT:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = scull_checkpoint(dev);
+			break;
+
+		case SCULL_IOCSTIER:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = __get_user(ul, (unsigned long __user *)arg);
+			if (retval == 0)
+				retval = scull_set_tier(dev, ul);
+			break;
+
+		case SCULL_IOCSFOLLOW:
+			retval = __get_user(tmp, (int __user *)arg);
+			if (retval)
+				break;
+			tmp = !!tmp;
+			if (tmp != sf->follow) {
+				if (tmp)
+					atomic_inc(&dev->followers);
+				else
+					atomic_dec(&dev->followers);
+				sf->follow = tmp;
+			}
+			break;
+
+		case SCULL_IOCTXN:
+			retval = scull_flush_wbuf(sf, 1);
+			if (retval == 0)
+				retval = scull_txn(dev, (struct scull_txn __user *)arg);
+			break;
+
+		case SCULL_IOCGPOOL:
+			if (down_interruptible(&dev->sem))
+				return -ERESTARTSYS;
+			spin_lock(&dev->pool_lock);
+			dev->pool_info.size = dev->pool ? scull_pool_size : 0;
+			dev->pool_info.nr = dev->pool_nr;
+			spin_unlock(&dev->pool_lock);
+			retval = copy_to_user((void __user *)arg, &dev->pool_info,
+					      sizeof(dev->pool_info)) ? -EFAULT : 0;
+			up(&dev->sem);
+			break;
+
+		case SCULL_IOCSBACKEND:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			if (copy_from_user(&be, (void __user *)arg, sizeof(be)))
+				return -EFAULT;
+			retval = scull_set_backend(dev, &be);
+			break;
+
+		case SCULL_IOCGBACKEND:
+			be.type = dev->backend;
+			be.order = dev->backend == SCULL_BACKEND_PAGES ?
+				   get_order(dev->quantum) : 0;
+			if (copy_to_user((void __user *)arg, &be, sizeof(be)))
+				return -EFAULT;
+			break;
+
+		case SCULL_IOCLOGSEEK:
+			retval = scull_flush_wbuf(sf, 1);
+			if (retval == 0)
+				retval = scull_log_seek(dev, filp,
+					(struct scull_logseek __user *)arg);
+			break;
+
+		case SCULL_IOCPREALLOC:
+			retval = scull_prealloc(dev,
+				(struct scull_prealloc __user *)arg);
+			break;
+
+		case SCULL_IOCFIEMAP:
+			retval = scull_flush_wbuf(sf, 1);
+			if (retval == 0)
+				retval = scull_fiemap(dev,
+					(struct scull_fiemap __user *)arg);
+			break;
+
+		case SCULL_IOCGTIER:
+			if (down_interruptible(&dev->sem))
+				return -ERESTARTSYS;
+			dev->tier.budget = dev->tier_budget;
+			dev->tier.resident = dev->alloc_bytes;
+			retval = copy_to_user((void __user *)arg, &dev->tier,
+					      sizeof(dev->tier)) ? -EFAULT : 0;
+			up(&dev->sem);
+			break;
+
+		case SCULL_IOCSEAL:
+			if (! capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			retval = scull_flush_wbuf(sf, 1);
+			if (!retval)
+				retval = scull_seal(dev);
+			break;
+
+		case SCULL_IOCQSEAL:
+			return dev->sealed;
+
+		case SCULL_IOCKVGET:
+		case SCULL_IOCKVPUT:
+		case SCULL_IOCKVDEL:
+		case SCULL_IOCKVMGET:
+			return scull_kv_ioctl(dev, cmd, arg);
+
+		case SCULL_IOCGWINDOW:
+			if (down_interruptible(&dev->sem))
+				return -ERESTARTSYS;
+			window.start = dev->start;
+			window.size = dev->size;
+			up(&dev->sem);
+			if (copy_to_user((void __user *)arg, &window, sizeof(window)))
+				return -EFAULT;
+			break;
+
+		case SCULL_IOCGGEOM:
+			if (down_interruptible(&dev->sem))
+				return -ERESTARTSYS;
+			/* report the target geometry while a re-layout runs */
+			geom.quantum = dev->migrating ? dev->mig_quantum : dev->quantum;
+			geom.qset = dev->migrating ? dev->mig_qset : dev->qset;
+			up(&dev->sem);
+			if (copy_to_user((void __user *)arg, &geom, sizeof(geom)))
+				return -EFAULT;
+			break;
 			
 		default:
 			return -ENOTTY;			
@@ -347,8 +4478,14 @@ int scull_ioctl (struct inode *inode, struct file *filp, unsigned int cmd, unsig
 
 static loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
-	struct scull_dev *dev = filp->private_data;
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
 	loff_t newpos;
+	int retval;
+
+	retval = scull_flush_wbuf(sf, 1);
+	if (retval)
+		return retval;
 	
 	switch(whence) {
 		case 0: /* SEEK_SET */
@@ -379,79 +4516,328 @@ struct file_operations scull_fops = {
 	.ioctl   = scull_ioctl,
 	.open    = scull_open,
 	.release = scull_release,
+	.fsync   = scull_fsync,
+	.poll    = scull_poll,
+	.splice_write = scull_splice_write,
 };
 
-int scull_setup_cdev(struct scull_dev *dev, int index)
+/* Reserve minor @index, or the lowest free one if @index is negative */
+static int scull_ctl_add(int index)
 {
-	int err = 0;
-	int devno = 0;
-
-	devno = MKDEV(scull_major, scull_minor + index);
-	cdev_init(&dev->cdev, &scull_fops);
-	dev->cdev.owner = THIS_MODULE;
-	dev->cdev.ops = &scull_fops;
-	err = cdev_add(&dev->cdev, devno, 1);
-	if (err) 
-		printk(KERN_NOTICE "Error %d adding scull%d\n", err, index);
-	
-	return err;
+	int id, retval;
+
+	if (index >= scull_nr_devs)
+		return -EINVAL;
+	do {
+		if (!idr_pre_get(&scull_idr, GFP_KERNEL))
+			return -ENOMEM;
+		retval = idr_get_new_above(&scull_idr, SCULL_DEV_RESERVED,
+					   index < 0 ? 0 : index, &id);
+	} while (retval == -EAGAIN);
+	if (retval)
+		return retval;
+	if (id >= scull_nr_devs || (index >= 0 && id != index)) {
+		idr_remove(&scull_idr, id);
+		return index < 0 ? -ENOSPC : -EEXIST;
+	}
+	return id;
 }
 
-int scull_dev_init(struct scull_dev **dev)
+static int scull_ctl_remove(int index)
 {
-	int retval = 0; 
+	struct scull_dev *dev;
 
-	*dev = kmalloc(sizeof(struct scull_dev), GFP_KERNEL);
-	if (!(*dev)) {
-		retval = -ENOMEM;
-		goto out;
-	}	
+	if (index < 0 || index >= scull_nr_devs)
+		return -EINVAL;
+	dev = idr_find(&scull_idr, index);
+	if (!dev)
+		return -ENODEV;
+	if (dev != SCULL_DEV_RESERVED && dev->users)
+		return -EBUSY;
+	idr_remove(&scull_idr, index);
+	if (dev != SCULL_DEV_RESERVED)
+		scull_dev_del(dev);
+	return 0;
+}
 
-	(*dev)->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-	if (!(*dev)->data) {
-		retval = -ENOMEM;
-		goto err0;
+static int scull_ctl_ioctl(struct inode *inode, struct file *filp,
+			   unsigned int cmd, unsigned long arg)
+{
+	int retval;
+
+	if (! capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (down_interruptible(&scull_devs_sem))
+		return -ERESTARTSYS;
+	switch (cmd) {
+		case SCULL_CTL_ADD:
+			retval = scull_ctl_add((int)arg);
+			break;
+
+		case SCULL_CTL_REMOVE:
+			retval = scull_ctl_remove((int)arg);
+			break;
+
+		default:
+			retval = -ENOTTY;
 	}
-	memset((*dev)->data, 0, sizeof(struct scull_qset));
-	(*dev)->quantum = scull_quantum;
-	(*dev)->qset = scull_qset;
-	(*dev)->size = 0;
-	//(*dev)->access_key = 0;
-	sema_init(&(*dev)->sem, 2);
-	retval = scull_setup_cdev((*dev), 0);
-	if (retval) 
-		goto err1;
-	else 
-		goto out;
-	
-err1:
-	kfree((*dev)->data);
-err0:
-	kfree(*dev);
-out:	
+	up(&scull_devs_sem);
 	return retval;
 }
 
-static void scull_dev_del(struct scull_dev **dev)
+static struct file_operations scull_ctl_fops = {
+	.owner   = THIS_MODULE,
+	.ioctl   = scull_ctl_ioctl,
+};
+
+static struct miscdevice scull_ctl_misc = {
+	.minor   = MISC_DYNAMIC_MINOR,
+	.name    = "scull-control",
+	.fops    = &scull_ctl_fops,
+};
+
+/*
+ * /proc/scullmem: one record per built instance, then a total. The
+ * seq_file position is the instance index, so picking up after a full
+ * page costs a lookup, not a walk over everything already shown.
+ */
+struct scull_mem_stats {
+	unsigned long qsets;		/* nodes on the list */
+	unsigned long arrays;		/* nodes holding any quantum */
+	unsigned long partial;		/* ... not every slot of which is used */
+	unsigned long quanta;		/* in RAM */
+	unsigned long spilled;		/* in the tier file */
+	unsigned long runs;		/* runs of adjacent quanta in RAM */
+	unsigned long longest;
+	unsigned long meta;		/* bytes of bookkeeping */
+};
+
+static void scull_mem_count(struct scull_qset *dptr, int qset,
+			    struct scull_mem_stats *st)
+{
+	unsigned long run = 0, bits = BITS_TO_LONGS(qset) * sizeof(long);
+	int i, n;
+
+	for (; dptr; dptr = dptr->next) {
+		st->qsets++;
+		st->meta += sizeof(*dptr) + qset * sizeof(void *);
+		if (dptr->crc)
+			st->meta += qset * sizeof(u32);
+		if (dptr->spill)
+			st->meta += qset * sizeof(u32);
+		if (dptr->dirty)
+			st->meta += bits;
+		if (dptr->ref)
+			st->meta += bits;
+		for (i = 0, n = 0; i < qset; i++) {
+			if (!dptr->data[i]) {
+				if (dptr->spill && dptr->spill[i])
+					st->spilled++;
+				run = 0;
+				continue;
+			}
+			n++;
+			if (!run++)
+				st->runs++;
+			if (run > st->longest)
+				st->longest = run;
+		}
+		st->quanta += n;
+		if (n)
+			st->arrays++;
+		if (n && n < qset)
+			st->partial++;
+	}
+}
+
+/* @a / @b in tenths of a percent */
+static unsigned long scull_permille(unsigned long a, unsigned long b)
+{
+	u64 x = (u64)a * 1000;
+
+	if (!b)
+		return 0;
+	do_div(x, b);
+	return (unsigned long)x;
+}
+
+/* Skip to the next built instance at or after *pos, or to the total */
+static loff_t *scull_mem_seek(loff_t *pos)
+{
+	struct scull_dev *dev;
+
+	for (; *pos < scull_nr_devs; (*pos)++) {
+		dev = idr_find(&scull_idr, *pos);
+		if (dev && dev != SCULL_DEV_RESERVED)
+			return pos;
+	}
+	return *pos == scull_nr_devs ? pos : NULL;
+}
+
+static void *scull_mem_start(struct seq_file *m, loff_t *pos)
+{
+	/* held until stop, instances can't go away under us */
+	down(&scull_devs_sem);
+	return scull_mem_seek(pos);
+}
+
+static void *scull_mem_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return scull_mem_seek(pos);
+}
+
+static void scull_mem_stop(struct seq_file *m, void *v)
+{
+	up(&scull_devs_sem);
+}
+
+static int scull_mem_total(struct seq_file *m)
+{
+	struct scull_mem_stats st;
+	struct scull_dev *dev;
+	unsigned long bytes = 0, devs = 0;
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < scull_nr_devs; i++) {
+		dev = idr_find(&scull_idr, i);
+		if (!dev)
+			continue;
+		devs++;
+		if (dev == SCULL_DEV_RESERVED)
+			continue;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		scull_mem_count(dev->data, dev->qset, &st);
+		scull_mem_count(dev->mig_old, dev->qset, &st);
+		scull_mem_count(dev->mig_data, dev->mig_qset, &st);
+		bytes += dev->alloc_bytes;
+		st.meta += sizeof(*dev);
+		up(&dev->sem);
+	}
+	seq_printf(m, "total: %lu instances, %lu bytes in quanta, "
+		   "%lu bytes meta (%lu.%lu%%)\n", devs, bytes, st.meta,
+		   scull_permille(st.meta, bytes) / 10,
+		   scull_permille(st.meta, bytes) % 10);
+	seq_printf(m, "  %lu runs, mean %lu quanta, longest %lu, "
+		   "%lu of %lu qsets partial\n", st.runs,
+		   st.runs ? st.quanta / st.runs : 0, st.longest,
+		   st.partial, st.arrays);
+	return 0;
+}
+
+static int scull_mem_show(struct seq_file *m, void *v)
+{
+	struct scull_mem_stats st;
+	struct scull_dev *dev;
+	unsigned long used, slots, holes, fill;
+	int idx = *(loff_t *)v;
+
+	if (idx == scull_nr_devs)
+		return scull_mem_total(m);
+	dev = idr_find(&scull_idr, idx);
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+
+	memset(&st, 0, sizeof(st));
+	scull_mem_count(dev->data, dev->qset, &st);
+	scull_mem_count(dev->mig_old, dev->qset, &st);
+	scull_mem_count(dev->mig_data, dev->mig_qset, &st);
+	st.meta += sizeof(*dev);
+	/* slots that would hold [start, size) with nothing in them */
+	slots = DIV_ROUND_UP(dev->size, dev->quantum) - dev->start / dev->quantum;
+	holes = slots > st.quanta + st.spilled ?
+		slots - (st.quanta + st.spilled) : 0;
+	used = dev->size - dev->start;
+	fill = scull_permille(used, (st.quanta + st.spilled) *
+			      (unsigned long)dev->quantum);
+
+	seq_printf(m, "scull%-3d mode %d %s quantum %d qset %d size %lu%s%s\n",
+		   idx, dev->mode, scull_backend_name[dev->backend],
+		   dev->quantum, dev->qset, dev->size,
+		   dev->migrating ? " migrating" : "",
+		   dev->flat ? " flat" : "");
+	seq_printf(m, "  %lu qsets (%lu with data, %lu partial), "
+		   "%lu quanta, %lu spilled, %lu holes\n", st.qsets,
+		   st.arrays, st.partial, st.quanta, st.spilled, holes);
+	seq_printf(m, "  fill %lu.%lu%%, %lu bytes in quanta, "
+		   "%lu bytes meta (%lu.%lu%%)\n", fill / 10, fill % 10,
+		   dev->alloc_bytes, st.meta,
+		   scull_permille(st.meta, dev->alloc_bytes) / 10,
+		   scull_permille(st.meta, dev->alloc_bytes) % 10);
+	seq_printf(m, "  %lu runs, longest %lu quanta, %lu pages gifted\n",
+		   st.runs, st.longest, dev->gifted);
+	up(&dev->sem);
+	return 0;
+}
+
+static struct seq_operations scull_mem_seq_ops = {
+	.start = scull_mem_start,
+	.next  = scull_mem_next,
+	.stop  = scull_mem_stop,
+	.show  = scull_mem_show,
+};
+
+static int scull_mem_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &scull_mem_seq_ops);
+}
+
+static struct file_operations scull_mem_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = scull_mem_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+};
+
+static void scull_cleanup(void)
 {
-	if ((*dev)->data) 
-		scull_trim(*dev);	
-	//(*dev)->access_key = 0;
-	cdev_del(&(*dev)->cdev);
-	kfree(*dev);
-	*dev = NULL;
+	struct scull_dev *dev;
+	int i, err;
+
+	/* the shrinker walks the instances without holding them */
+	if (scull_pool_shrinker)
+		remove_shrinker(scull_pool_shrinker);
+	scull_pool_shrinker = NULL;
+	for (i = 0; i < scull_nr_devs; i++) {
+		dev = idr_find(&scull_idr, i);
+		if (!dev)
+			continue;
+		idr_remove(&scull_idr, i);
+		if (dev == SCULL_DEV_RESERVED)
+			continue;
+		/* a device still waiting for its lazy restore has nothing to save */
+		if (scull_backing && *scull_backing && !dev->restore_pending &&
+		    (err = scull_save(dev)))
+			printk(KERN_NOTICE "scull%d: save failed %d\n", i, err);
+		scull_dev_del(dev);
+	}
+	idr_destroy(&scull_idr);
+	scull_qset_caches_destroy();
 }
 
 static int __init scull_init(void)
 {
+	struct proc_dir_entry *entry;
+	struct scull_dev *sdev;
 	int result = 0;
 
 	printk(KERN_ALERT "Hello World\n");
 
-	if (scull_major) {
+	if (scull_backend < SCULL_BACKEND_KMALLOC ||
+	    scull_backend > SCULL_BACKEND_VMALLOC ||
+	    scull_order < 0 || scull_order >= MAX_ORDER) {
+		printk(KERN_WARNING "scull: bad backend %d order %d\n",
+		       scull_backend, scull_order);
+		return -EINVAL;
+	}
+
+	if (scull_major) {
 		dev = MKDEV(scull_major,scull_minor);
 		result = register_chrdev_region(dev, scull_nr_devs, "scull");
-	} else {
+	} else {
 		result = alloc_chrdev_region(&dev, scull_minor, scull_nr_devs, \
 			"scull");
 		scull_major = MAJOR(dev);
@@ -461,13 +4847,59 @@ static int __init scull_init(void)
 		printk(KERN_WARNING "scull: can't get major %d\n", scull_major);
 		goto out;
 	}
-	
-	result = scull_dev_init(&scull_dev); 
-	if (result) 
+
+	scull_pool_wq = create_singlethread_workqueue("scull_pool");
+	if (!scull_pool_wq) {
+		result = -ENOMEM;
 		goto err0;
-	else
-		goto out;
+	}
+	scull_pool_shrinker = set_shrinker(DEFAULT_SEEKS, scull_pool_shrink);
+	if (!scull_pool_shrinker)
+		printk(KERN_NOTICE "scull: no shrinker, pools stay full\n");
+
+	/* one cdev for the whole range, open looks the instance up */
+	cdev_init(&scull_cdev, &scull_fops);
+	scull_cdev.owner = THIS_MODULE;
+	result = cdev_add(&scull_cdev, dev, scull_nr_devs);
+	if (result) {
+		printk(KERN_NOTICE "Error %d adding scull\n", result);
+		goto err1;
+	}
 
+	/* scull0 is there from the start, as it always was */
+	down(&scull_devs_sem);
+	result = scull_ctl_add(0);
+	sdev = NULL;
+	if (result >= 0 && scull_backing && *scull_backing &&
+	    !scull_restore_lazy)
+		sdev = scull_dev_get(0);
+	up(&scull_devs_sem);
+	if (result < 0)
+		goto err2;
+	if (IS_ERR(sdev)) {
+		result = PTR_ERR(sdev);
+		goto err3;
+	}
+	if (sdev && (result = scull_restore(sdev)) && result != -ENOENT)
+		printk(KERN_NOTICE "scull: restore failed %d\n", result);
+	result = 0;
+
+	result = misc_register(&scull_ctl_misc);
+	if (result)
+		goto err3;
+	entry = create_proc_entry("scullmem", 0, NULL);
+	if (entry)
+		entry->proc_fops = &scull_mem_proc_ops;
+	goto out;
+
+err3:
+	scull_cleanup();
+err2:
+	cdev_del(&scull_cdev);
+err1:
+	if (scull_pool_shrinker)
+		remove_shrinker(scull_pool_shrinker);
+	destroy_workqueue(scull_pool_wq);
 err0:
 	unregister_chrdev_region(dev, scull_nr_devs);
 out:
@@ -476,7 +4908,11 @@ out:
 
 static void __exit scull_exit(void)
 {
-	scull_dev_del(&scull_dev);
+	remove_proc_entry("scullmem", NULL);
+	misc_deregister(&scull_ctl_misc);
+	cdev_del(&scull_cdev);
+	scull_cleanup();
+	destroy_workqueue(scull_pool_wq);
 	unregister_chrdev_region(dev, scull_nr_devs);
 	printk(KERN_ALERT "Goodbye, Cruel World\n");
 }
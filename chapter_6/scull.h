@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2022, Jax<coolbeaner@126.com>.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * In-kernel interface to scull, for other modules. Everything here may
+ * sleep, so it is for process context only.
+ */
+#ifndef _SCULL_H_
+#define _SCULL_H_
+
+#include <linux/types.h>
+#include <linux/uio.h>
+#include <linux/bio.h>
+
+struct scull_dev;
+
+/* A quantum lent out by scull_borrow(), the device is locked meanwhile */
+struct scull_lease {
+	void *ptr;			/* first byte at pos */
+	size_t len;			/* bytes usable from ptr */
+	/* private to scull */
+	struct scull_dev *dev;
+	loff_t pos;
+	int write;
+	int locked;
+};
+
+/* hold instance @index (minor - scull_minor) against removal */
+extern struct scull_dev *scull_get(int index);
+extern void scull_put(struct scull_dev *dev);
+
+/* like read()/write(), advancing *pos; a read stops at a hole */
+extern ssize_t scull_kread(struct scull_dev *dev, const struct kvec *vec,
+			   unsigned long nr, loff_t *pos);
+extern ssize_t scull_kwrite(struct scull_dev *dev, const struct kvec *vec,
+			    unsigned long nr, loff_t *pos);
+extern ssize_t scull_kread_pages(struct scull_dev *dev,
+				 const struct bio_vec *bv, unsigned long nr,
+				 loff_t *pos);
+extern ssize_t scull_kwrite_pages(struct scull_dev *dev,
+				  const struct bio_vec *bv, unsigned long nr,
+				  loff_t *pos);
+
+/* direct access to the quantum holding @pos, no copy at all */
+extern int scull_borrow(struct scull_dev *dev, loff_t pos, int write,
+			struct scull_lease *lease);
+extern void scull_return(struct scull_lease *lease, size_t written);
+
+#endif /* _SCULL_H_ */
@@ -25,6 +25,12 @@
 #include <asm/semaphore.h>
 #include <linux/ioctl.h>
 #include <linux/capability.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 
   
 #define SCULL_IOC_MAGIC 'k'
@@ -53,6 +59,9 @@
 #define SCULL_IOC_MAXNR 	14
 #define SCULL_QUANTUM  		4096
 #define SCULL_QSET		1024  
+#define SCULLC_MAG_ROUNDS	14	/* a magazine is 128 bytes on 64-bit */
+#define SCULLC_DEPOT		16
+#define SCULLC_BATCH		32	/* quanta one write may fill */
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Jax");
@@ -62,8 +71,46 @@ struct scull_qset {
 	struct scull_qset *next;
 };
 
+/* A stack of free quanta, kept full or empty in the depot */
+struct scullc_mag {
+	struct scullc_mag *next;	/* in the depot */
+	int rounds;			/* quanta held */
+	void *obj[SCULLC_MAG_ROUNDS];
+};
+
+/* The two magazines of a CPU, only touched with preemption off */
+struct scullc_cpu {
+	struct scullc_mag *loaded;
+	struct scullc_mag *prev;
+	unsigned long alloc_hit, alloc_miss;
+	unsigned long free_hit, free_miss;
+	unsigned long flushed;		/* magazines sent back to the slab */
+};
+
+/*
+ * One slab per quantum size, shared by the devices using that size.
+ * It is created by the first device and destroyed with the last one.
+ * Quanta are freed into and taken from per-CPU magazines first, whole
+ * magazines go through the depot, and only then to the slab.
+ */
+struct scullc_cache {
+	struct list_head list;
+	int size;
+	int users;			/* devices holding it */
+	kmem_cache_t *cache;
+	struct scullc_cpu *cpu;
+	spinlock_t depot_lock;		/* protects the fields below */
+	struct scullc_mag *full;
+	struct scullc_mag *empty;
+	int nfull, nempty;
+	unsigned long depot_get, depot_put;
+	unsigned long shrunk;		/* quanta released by the shrinker */
+	char name[24];
+};
+
 struct scull_dev {
 	struct scull_qset *data;
+	struct scullc_cache *cache;	/* quanta of dev->quantum bytes */
 	int quantum;
 	int qset;
 	unsigned long size;
@@ -77,42 +124,359 @@ static int scull_major = 0;
 static int scull_quantum = SCULL_QUANTUM;
 static int scull_qset = SCULL_QSET;
 static int scull_nr_devs = 4;
+static int scullc_depot = SCULLC_DEPOT;	/* full magazines per cache */
 static dev_t dev = 0;
 static struct scull_dev *scull_dev = NULL;
-/* ٻָ룬豸 */
-kmem_cache_t *scullc_cache = NULL;
+/* ٻÿӴСһ */
+static LIST_HEAD(scullc_caches);
+static DECLARE_MUTEX(scullc_caches_sem);
+static struct shrinker *scullc_shrinker;
 
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
+module_param(scullc_depot, int, S_IRUGO);
 
-int scull_trim(struct scull_dev *dev)
+static void scullc_mag_flush(struct scullc_cache *c, struct scullc_mag *m)
+{
+	while (m->rounds)
+		kmem_cache_free(c->cache, m->obj[--m->rounds]);
+}
+
+static struct scullc_mag *scullc_mag_alloc(gfp_t flags)
+{
+	struct scullc_mag *m;
+
+	m = kmalloc(sizeof(*m), flags);
+	if (m)
+		memset(m, 0, sizeof(*m));
+	return m;
+}
+
+static void scullc_cpu_swap(struct scullc_cpu *pc)
 {
+	struct scullc_mag *tmp = pc->loaded;
+
+	pc->loaded = pc->prev;
+	pc->prev = tmp;
+}
 
+/* Both magazines are empty: trade one for a full magazine of the depot */
+static int scullc_depot_get(struct scullc_cache *c, struct scullc_cpu *pc)
+{
+	struct scullc_mag *m;
+
+	spin_lock(&c->depot_lock);
+	m = c->full;
+	if (m) {
+		c->full = m->next;
+		c->nfull--;
+		pc->prev->next = c->empty;
+		c->empty = pc->prev;
+		c->nempty++;
+		c->depot_get++;
+		pc->prev = pc->loaded;
+		pc->loaded = m;
+	}
+	spin_unlock(&c->depot_lock);
+
+	return m != NULL;
+}
+
+/* Both magazines are full: park one in the depot, or give it to the slab */
+static void scullc_depot_put(struct scullc_cache *c, struct scullc_cpu *pc)
+{
+	struct scullc_mag *m = NULL;
+
+	spin_lock(&c->depot_lock);
+	if (c->nfull < scullc_depot && c->empty) {
+		m = c->empty;
+		c->empty = m->next;
+		c->nempty--;
+	}
+	spin_unlock(&c->depot_lock);
+	if (!m && c->nfull < scullc_depot)
+		m = scullc_mag_alloc(GFP_NOWAIT);
+	if (m) {
+		spin_lock(&c->depot_lock);
+		pc->prev->next = c->full;
+		c->full = pc->prev;
+		c->nfull++;
+		c->depot_put++;
+		spin_unlock(&c->depot_lock);
+		pc->prev = m;
+	} else {
+		scullc_mag_flush(c, pc->prev);
+		pc->flushed++;
+	}
+	scullc_cpu_swap(pc);
+}
+
+/*
+ * Fill objs[0..n) from this CPU's magazines and the depot, a magazine
+ * at a time, and the rest from the slab. Returns how many were had.
+ */
+static int scullc_alloc_bulk(struct scullc_cache *c, int n, void **objs)
+{
+	struct scullc_cpu *pc;
+	struct scullc_mag *m;
+	int got = 0, k;
+
+	pc = per_cpu_ptr(c->cpu, get_cpu());
+	while (got < n) {
+		if (!pc->loaded->rounds && pc->prev->rounds)
+			scullc_cpu_swap(pc);
+		if (!pc->loaded->rounds && !scullc_depot_get(c, pc))
+			break;
+		m = pc->loaded;
+		k = min(n - got, m->rounds);
+		m->rounds -= k;
+		memcpy(objs + got, m->obj + m->rounds, k * sizeof(void *));
+		got += k;
+	}
+	pc->alloc_hit += got;
+	pc->alloc_miss += n - got;
+	put_cpu();
+
+	for (; got < n; got++) {
+		objs[got] = kmem_cache_alloc(c->cache, GFP_KERNEL);
+		if (!objs[got])
+			break;
+	}
+	return got;
+}
+
+/* Put objs[0..n) back, whole magazines go on to the depot */
+static void scullc_free_bulk(struct scullc_cache *c, int n, void **objs)
+{
+	struct scullc_cpu *pc;
+	struct scullc_mag *m;
+	int done = 0, miss = 0, k;
+
+	pc = per_cpu_ptr(c->cpu, get_cpu());
+	while (done < n) {
+		if (pc->loaded->rounds == SCULLC_MAG_ROUNDS &&
+		    pc->prev->rounds < SCULLC_MAG_ROUNDS)
+			scullc_cpu_swap(pc);
+		if (pc->loaded->rounds == SCULLC_MAG_ROUNDS) {
+			scullc_depot_put(c, pc);
+			miss++;
+		}
+		m = pc->loaded;
+		k = min(n - done, SCULLC_MAG_ROUNDS - m->rounds);
+		memcpy(m->obj + m->rounds, objs + done, k * sizeof(void *));
+		m->rounds += k;
+		done += k;
+	}
+	pc->free_hit += n - miss;
+	pc->free_miss += miss;
+	put_cpu();
+}
+
+/* No one uses the cache any more, give every quantum back to the slab */
+static void scullc_cache_drain(struct scullc_cache *c)
+{
+	struct scullc_cpu *pc;
+	struct scullc_mag *m;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(c->cpu, cpu);
+		if (pc->loaded)
+			scullc_mag_flush(c, pc->loaded);
+		if (pc->prev)
+			scullc_mag_flush(c, pc->prev);
+		kfree(pc->loaded);
+		kfree(pc->prev);
+		pc->loaded = pc->prev = NULL;
+	}
+	while ((m = c->full)) {
+		c->full = m->next;
+		scullc_mag_flush(c, m);
+		kfree(m);
+	}
+	while ((m = c->empty)) {
+		c->empty = m->next;
+		kfree(m);
+	}
+	c->nfull = c->nempty = 0;
+}
+
+static int scullc_cache_mags(struct scullc_cache *c)
+{
+	struct scullc_cpu *pc;
+	int cpu;
+
+	spin_lock_init(&c->depot_lock);
+	c->full = c->empty = NULL;
+	c->nfull = c->nempty = 0;
+	c->depot_get = c->depot_put = c->shrunk = 0;
+	c->cpu = alloc_percpu(struct scullc_cpu);
+	if (!c->cpu)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(c->cpu, cpu);
+		pc->loaded = scullc_mag_alloc(GFP_KERNEL);
+		pc->prev = scullc_mag_alloc(GFP_KERNEL);
+		if (!pc->loaded || !pc->prev) {
+			scullc_cache_drain(c);
+			free_percpu(c->cpu);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static struct scullc_cache *scullc_cache_get(int size)
+{
+	struct scullc_cache *c;
+
+	if (size <= 0)
+		return NULL;
+
+	down(&scullc_caches_sem);
+	list_for_each_entry(c, &scullc_caches, list)
+		if (c->size == size) {
+			c->users++;
+			goto out;
+		}
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		goto out;
+	snprintf(c->name, sizeof(c->name), "scullc_%d", size);
+	/* ûctor/dtor */
+	c->cache = kmem_cache_create(c->name, size, 0, SLAB_HWCACHE_ALIGN,
+				     NULL, NULL);
+	if (!c->cache) {
+		kfree(c);
+		c = NULL;
+		goto out;
+	}
+	if (scullc_cache_mags(c)) {
+		kmem_cache_destroy(c->cache);
+		kfree(c);
+		c = NULL;
+		goto out;
+	}
+	c->size = size;
+	c->users = 1;
+	list_add(&c->list, &scullc_caches);
+out:
+	up(&scullc_caches_sem);
+	return c;
+}
+
+/* Every object of the cache has been freed by the caller */
+static void scullc_cache_put(struct scullc_cache *c)
+{
+	down(&scullc_caches_sem);
+	if (--c->users == 0) {
+		list_del(&c->list);
+		scullc_cache_drain(c);
+		free_percpu(c->cpu);
+		kmem_cache_destroy(c->cache);
+		kfree(c);
+	}
+	up(&scullc_caches_sem);
+}
+
+/*
+ * Memory pressure empties the depots, the per-CPU magazines are left
+ * alone. Reclaim may run under scullc_caches_sem, so only try for it.
+ */
+static int scullc_shrink(int nr, gfp_t gfp_mask)
+{
+	struct scullc_cache *c;
+	struct scullc_mag *m, *next;
+	int left = 0;
+
+	if (down_trylock(&scullc_caches_sem))
+		return nr ? -1 : 0;
+	list_for_each_entry(c, &scullc_caches, list) {
+		while (nr > 0) {
+			spin_lock(&c->depot_lock);
+			m = c->full;
+			if (m) {
+				c->full = m->next;
+				c->nfull--;
+				c->shrunk += m->rounds;
+			}
+			spin_unlock(&c->depot_lock);
+			if (!m)
+				break;
+			nr -= m->rounds;
+			scullc_mag_flush(c, m);
+			kfree(m);
+		}
+		if (nr > 0) {
+			spin_lock(&c->depot_lock);
+			m = c->empty;
+			c->empty = NULL;
+			c->nempty = 0;
+			spin_unlock(&c->depot_lock);
+			for (; m; m = next) {
+				next = m->next;
+				kfree(m);
+			}
+		}
+		left += c->nfull * SCULLC_MAG_ROUNDS;
+	}
+	up(&scullc_caches_sem);
+
+	return left;
+}
+
+static void scull_free_data(struct scull_dev *dev)
+{
 	struct scull_qset *next, *dptr;
 	int qset = dev->qset;
-	int i;
+	int i, n;
 	
 	for (dptr = dev->data; dptr; dptr = next) {
 		if (dptr->data) {
-			for (i = 0; i < qset; i++)
+			/* pack the quanta to the front, free them in one go */
+			for (i = n = 0; i < qset; i++)
 				if (dptr->data[i])
-					kmem_cache_free(scullc_cache,dptr->data[i]);
+					dptr->data[n++] = dptr->data[i];
+			scullc_free_bulk(dev->cache, n, dptr->data);
 			kfree(dptr->data);
 			dptr->data = NULL;
 		}
 		next = dptr->next;
 		kfree(dptr);
 	}
-	
 	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
 	dev->data = NULL;
+}
+
+/*
+ * Free everything and take up the current quantum and qset. If no slab
+ * can be had for a new quantum the device keeps the old one.
+ */
+int scull_trim(struct scull_dev *dev)
+{
+	struct scullc_cache *cache;
+	int retval = 0;
+
+	scull_free_data(dev);
+	dev->qset = scull_qset;
+
+	if (scull_quantum != dev->quantum) {
+		cache = scullc_cache_get(scull_quantum);
+		if (cache) {
+			scullc_cache_put(dev->cache);
+			dev->cache = cache;
+			dev->quantum = scull_quantum;
+		} else {
+			printk(KERN_WARNING "scullc: no cache for quantum %d\n",
+			       scull_quantum);
+			retval = -ENOMEM;
+		}
+	}
 	
-	return 0;
+	return retval;
 	
 }
 
@@ -123,6 +487,12 @@ struct scull_qset* scull_follow(struct scull_dev *dev, int item)
 	if (!dev)
 		goto out;
 	
+	if (!dev->data) {
+		dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+		if (!dev->data)
+			goto out;
+		memset(dev->data, 0, sizeof(struct scull_qset));
+	}
 	for (dptr = dev->data; dptr && item > 0; item--) {
 		if (!dptr->next) {
 			dptr->next = \
@@ -143,6 +513,15 @@ int scull_open (struct inode *inode, struct file *filp)
 	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
 	filp->private_data = dev;
 
+	/* an empty device takes up a new quantum, it has nothing to move */
+	if (dev->size == 0 && dev->quantum != scull_quantum) {
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		if (dev->size == 0)
+			scull_trim(dev);
+		up(&dev->sem);
+	}
+
 	/*
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
 		scull_trim(dev);
@@ -161,14 +540,16 @@ ssize_t scull_read (struct file *filp, char __user *buf, size_t count, loff_t *f
 {
 	struct scull_dev *dev = filp->private_data;
 	struct scull_qset *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
+	int quantum, qset, itemsize;
 	int item, s_pos, q_pos, rest;
 	ssize_t retval =  0;
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
+	/* open() may switch an empty device to a new quantum */
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
 	if (*f_pos >= dev->size) 
 		goto out;
 	
@@ -205,14 +586,18 @@ ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, lo
 {
 	struct scull_dev *dev = filp->private_data;
 	struct scull_qset *dptr;
-	int quantum = dev->quantum;
-	int qset = dev->qset;
-	int itemsize = quantum * qset;
+	void *objs[SCULLC_BATCH];
+	int quantum, qset, itemsize;
 	int item, s_pos, q_pos, rest;
+	int i, n, got, last;
+	size_t chunk, done = 0;
 	ssize_t retval =  -ENOMEM;
 	
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
 	item = (long)*f_pos / itemsize;
 	rest = (long)*f_pos % itemsize;
 	s_pos = rest / quantum;
@@ -226,20 +611,44 @@ ssize_t scull_write (struct file *filp, const char __user *buf, size_t count, lo
 			goto out;
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-	if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-		retval = -EFAULT;
+
+	/*
+	 * Take up to SCULLC_BATCH quanta of this qset at once, with every
+	 * missing quantum allocated in a single call.
+	 */
+	last = min(qset, s_pos + SCULLC_BATCH);
+	if (count > (size_t)(last - s_pos) * quantum - q_pos)
+		count = (size_t)(last - s_pos) * quantum - q_pos;
+	if (!count) {
+		retval = 0;
 		goto out;
 	}
+	last = s_pos + (q_pos + count - 1) / quantum;
+	for (i = s_pos, n = 0; i <= last; i++)
+		if (!dptr->data[i])
+			n++;
+	if (n) {
+		got = scullc_alloc_bulk(dev->cache, n, objs);
+		for (i = s_pos, n = 0; i <= last && n < got; i++)
+			if (!dptr->data[i])
+				dptr->data[i] = objs[n++];
+	}
+
+	/* stop at the first quantum we could not get */
+	for (i = s_pos; i <= last && dptr->data[i]; i++) {
+		chunk = min(count - done, (size_t)(quantum - q_pos));
+		if (copy_from_user(dptr->data[i] + q_pos, buf + done, chunk)) {
+			retval = -EFAULT;
+			break;
+		}
+		done += chunk;
+		q_pos = 0;
+	}
+	if (!done)
+		goto out;
 	
-	*f_pos += count;
-	retval = count;
+	*f_pos += done;
+	retval = done;
 
 	if (dev->size < *f_pos)
 		dev->size = *f_pos;
@@ -385,6 +794,97 @@ struct file_operations scull_fops = {
 	.release = scull_release,
 };
 
+/* /proc/scullcmag: one record per quantum size in use */
+static void *scullc_mag_start(struct seq_file *m, loff_t *pos)
+{
+	struct scullc_cache *c;
+	loff_t n = *pos;
+
+	/* held until stop, caches can't go away under us */
+	down(&scullc_caches_sem);
+	if (n == 0)
+		return SEQ_START_TOKEN;
+	list_for_each_entry(c, &scullc_caches, list)
+		if (--n == 0)
+			return c;
+	return NULL;
+}
+
+static void *scullc_mag_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct list_head *next;
+
+	if (v == SEQ_START_TOKEN)
+		next = scullc_caches.next;
+	else
+		next = ((struct scullc_cache *)v)->list.next;
+	(*pos)++;
+	if (next == &scullc_caches)
+		return NULL;
+	return list_entry(next, struct scullc_cache, list);
+}
+
+static void scullc_mag_stop(struct seq_file *m, void *v)
+{
+	up(&scullc_caches_sem);
+}
+
+static unsigned long scullc_pct(unsigned long hit, unsigned long miss)
+{
+	return hit + miss ? hit * 100 / (hit + miss) : 0;
+}
+
+static int scullc_mag_show(struct seq_file *m, void *v)
+{
+	struct scullc_cache *c = v;
+	struct scullc_cpu *pc;
+	unsigned long ah = 0, am = 0, fh = 0, fm = 0, fl = 0;
+	int cpu;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(m, "magazine %d rounds, depot %d magazines\n",
+			   SCULLC_MAG_ROUNDS, scullc_depot);
+		return 0;
+	}
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(c->cpu, cpu);
+		ah += pc->alloc_hit;
+		am += pc->alloc_miss;
+		fh += pc->free_hit;
+		fm += pc->free_miss;
+		fl += pc->flushed;
+	}
+	seq_printf(m, "%s users %d\n", c->name, c->users);
+	seq_printf(m, "  alloc %lu hit %lu miss (%lu%%), "
+		   "free %lu hit %lu miss (%lu%%)\n",
+		   ah, am, scullc_pct(ah, am), fh, fm, scullc_pct(fh, fm));
+	seq_printf(m, "  depot %d full %d empty, %lu taken %lu parked, "
+		   "%lu flushed, %lu quanta shrunk\n",
+		   c->nfull, c->nempty, c->depot_get, c->depot_put, fl,
+		   c->shrunk);
+	return 0;
+}
+
+static struct seq_operations scullc_mag_seq_ops = {
+	.start = scullc_mag_start,
+	.next  = scullc_mag_next,
+	.stop  = scullc_mag_stop,
+	.show  = scullc_mag_show,
+};
+
+static int scullc_mag_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &scullc_mag_seq_ops);
+}
+
+static struct file_operations scullc_mag_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = scullc_mag_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = seq_release,
+};
+
 int scull_setup_cdev(struct scull_dev *dev, int index)
 {
 	int err = 0;
@@ -411,10 +911,9 @@ int scull_dev_init(struct scull_dev **dev)
 		goto out;
 	}	
 
-	/* һٻ */
-	scullc_cache = kmem_cache_create("scullc", scull_quantum,	\
-				0, SLAB_HWCACHE_ALIGN, NULL, NULL); /* ûctor/dtor */
-	if (!scullc_cache) {
+	/* ȡñӴСĸٻ */
+	(*dev)->cache = scullc_cache_get(scull_quantum);
+	if (!(*dev)->cache) {
 		retval = -ENOMEM;
 		goto err0;
 	}
@@ -429,7 +928,7 @@ int scull_dev_init(struct scull_dev **dev)
 	(*dev)->qset = scull_qset;
 	(*dev)->size = 0;
 	//(*dev)->access_key = 0;
-	sema_init(&(*dev)->sem, 2);
+	sema_init(&(*dev)->sem, 1);
 	retval = scull_setup_cdev((*dev), 0);
 	if (retval) 
 		goto err2;
@@ -439,7 +938,7 @@ int scull_dev_init(struct scull_dev **dev)
 err2:
 	kfree((*dev)->data);
 err1:
-	kmem_cache_destroy(scullc_cache);
+	scullc_cache_put((*dev)->cache);
 err0:
 	kfree(*dev);
 out:	
@@ -449,17 +948,17 @@ out:
 static void scull_dev_del(struct scull_dev **dev)
 {
 	if ((*dev)->data) 
-		scull_trim(*dev);	
+		scull_free_data(*dev);	
 	//(*dev)->access_key = 0;
 	cdev_del(&(*dev)->cdev);
-	if (scullc_cache)
-		kmem_cache_destroy(scullc_cache);
+	scullc_cache_put((*dev)->cache);
 	kfree(*dev);
 	*dev = NULL;
 }
 
 static int __init scull_init(void)
 {
+	struct proc_dir_entry *entry;
 	int result = 0;
 
 	printk(KERN_ALERT "Hello World\n");
@@ -483,8 +982,14 @@ static int __init scull_init(void)
 	result = scull_dev_init(&scull_dev); 
 	if (result) 
 		goto err0;
-	else
-		goto out;
+
+	scullc_shrinker = set_shrinker(DEFAULT_SEEKS, scullc_shrink);
+	if (!scullc_shrinker)
+		printk(KERN_NOTICE "scullc: no shrinker, depots stay full\n");
+	entry = create_proc_entry("scullcmag", 0, NULL);
+	if (entry)
+		entry->proc_fops = &scullc_mag_proc_ops;
+	goto out;
 
 err0:
 	unregister_chrdev_region(dev, scull_nr_devs);
@@ -494,6 +999,9 @@ out:
 
 static void __exit scull_exit(void)
 {
+	remove_proc_entry("scullcmag", NULL);
+	if (scullc_shrinker)
+		remove_shrinker(scullc_shrinker);
 	scull_dev_del(&scull_dev);
 	unregister_chrdev_region(dev, scull_nr_devs);
 	printk(KERN_ALERT "Goodbye, Cruel World\n");